@@ -0,0 +1,437 @@
+#include "Channel.h"
+#include "HeapDump.h"
+#include "Profiler.h"
+#include "STM.h"
+
+#include <algorithm>
+#include <atomic>
+#include <iostream>
+#include <thread>
+
+#include <sys/mman.h>
+#include <ucontext.h>
+
+// Coroutine stacks are reserved rather than committed up front, so unused
+// stack costs address space only.
+static const size_t stackSize = 256 << 10;
+static const size_t guardSize = 4 << 10;
+
+// All channel state is guarded by this one lock, which makes alts! simple
+// to get right: no operation is ever half-registered.
+static std::mutex s_channelMutex;
+
+class Scheduler;
+
+class Coroutine {
+public:
+    Coroutine(malValuePtr op, malValuePtr result, Scheduler* home);
+    ~Coroutine();
+
+    static void main();
+
+    ucontext_t          context;
+    Scheduler*          home;
+    bool                isFinished;
+    CallStack::Frames   calls;
+    HeapRoots*          roots;
+
+private:
+    void run();
+
+    malValuePtr m_op;
+    malValuePtr m_result;
+    char*       m_stack;
+};
+
+class Scheduler {
+public:
+    static Scheduler* pick();
+
+    void schedule(Coroutine* coroutine);
+
+    // Switches from the running coroutine back to its scheduler, which
+    // only unlocks the channel lock once the coroutine has stopped
+    // running, so that it can't be woken before then.
+    static void park(std::unique_lock<std::mutex>& lock);
+
+    ucontext_t context;
+
+private:
+    Scheduler() : m_unlockAfterSwitch(NULL) { }
+
+    void main();
+
+    std::mutex                  m_mutex;
+    std::condition_variable     m_wakeUp;
+    std::deque<Coroutine*>      m_ready;
+    std::mutex*                 m_unlockAfterSwitch;
+};
+
+static thread_local Coroutine* t_coroutine = NULL;
+
+struct malChannel::Waiter {
+    Waiter() : isDone(false), coroutine(t_coroutine) { }
+
+    bool                    isDone;
+    malValuePtr             value;
+    malValuePtr             channel;
+    Coroutine*              coroutine; // NULL for a plain thread
+    std::condition_variable done;
+};
+
+Coroutine::Coroutine(malValuePtr op, malValuePtr result, Scheduler* home)
+: home(home)
+, isFinished(false)
+, calls()
+, roots(NULL)
+, m_op(op)
+, m_result(result)
+{
+    m_stack = static_cast<char*>(mmap(NULL, stackSize,
+                                      PROT_READ | PROT_WRITE,
+                                      MAP_PRIVATE | MAP_ANONYMOUS |
+                                      MAP_NORESERVE, -1, 0));
+    MAL_CHECK(m_stack != MAP_FAILED, "Can't allocate a go block stack");
+    mprotect(m_stack, guardSize, PROT_NONE);
+
+    getcontext(&context);
+    context.uc_stack.ss_sp = m_stack;
+    context.uc_stack.ss_size = stackSize;
+    context.uc_link = &home->context;
+    makecontext(&context, &Coroutine::main, 0);
+}
+
+Coroutine::~Coroutine()
+{
+    munmap(m_stack, stackSize);
+}
+
+void Coroutine::main()
+{
+    t_coroutine->run();
+    t_coroutine->isFinished = true;
+    // Returning resumes the scheduler, through uc_link.
+}
+
+void Coroutine::run()
+{
+    malChannel* result = STATIC_CAST(malChannel, m_result);
+    try {
+        malValueVec noArgs;
+        malValuePtr value = APPLY(m_op, noArgs.begin(), noArgs.end());
+        if (value != mal::nilValue()) {
+            result->put(value);
+        }
+    }
+    catch (String& s) {
+        std::cerr << "Error in go block: " << s << "\n";
+    }
+    catch (malValuePtr& mv) {
+        std::cerr << "Error in go block: " << mv->print(true) << "\n";
+    }
+    catch (...) {
+        std::cerr << "Error in go block\n";
+    }
+    result->close();
+}
+
+Scheduler* Scheduler::pick()
+{
+    static std::vector<Scheduler*>* schedulers = [] {
+        int count = std::max(1u, std::thread::hardware_concurrency());
+        std::vector<Scheduler*>* schedulers = new std::vector<Scheduler*>;
+        for (int i = 0; i < count; i++) {
+            Scheduler* scheduler = new Scheduler;
+            schedulers->push_back(scheduler);
+            std::thread(&Scheduler::main, scheduler).detach();
+        }
+        return schedulers;
+    }();
+    static std::atomic<unsigned> next(0);
+
+    return (*schedulers)[next++ % schedulers->size()];
+}
+
+void Scheduler::schedule(Coroutine* coroutine)
+{
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_ready.push_back(coroutine);
+    }
+    m_wakeUp.notify_one();
+}
+
+void Scheduler::park(std::unique_lock<std::mutex>& lock)
+{
+    Coroutine* coroutine = t_coroutine;
+    Scheduler* home = coroutine->home;
+
+    home->m_unlockAfterSwitch = lock.release();
+    swapcontext(&coroutine->context, &home->context);
+    lock = std::unique_lock<std::mutex>(s_channelMutex);
+}
+
+void Scheduler::main()
+{
+    for (;;) {
+        Coroutine* coroutine;
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            m_wakeUp.wait(lock, [this] { return !m_ready.empty(); });
+            coroutine = m_ready.front();
+            m_ready.pop_front();
+        }
+
+        t_coroutine = coroutine;
+        CallStack::Frames* calls = CallStack::swap(&coroutine->calls);
+        HeapRoots* roots = HeapRoots::swap(coroutine->roots);
+        swapcontext(&context, &coroutine->context);
+        coroutine->roots = HeapRoots::swap(roots);
+        CallStack::swap(calls);
+        t_coroutine = NULL;
+
+        if (m_unlockAfterSwitch != NULL) {
+            m_unlockAfterSwitch->unlock();
+            m_unlockAfterSwitch = NULL;
+        }
+        if (coroutine->isFinished) {
+            delete coroutine;
+            RefCounted::stopSharing();
+        }
+    }
+}
+
+malValuePtr startGoBlock(malValuePtr op)
+{
+    malValuePtr result = mal::channel(1);
+    Scheduler* home = Scheduler::pick();
+
+    RefCounted::startSharing();
+    home->schedule(new Coroutine(op, result, home));
+    return result;
+}
+
+bool isInGoBlock()
+{
+    return t_coroutine != NULL;
+}
+
+// Called with the channel lock held.
+static void complete(const malChannel::WaiterPtr& waiter,
+                     malValuePtr value, malValuePtr channel)
+{
+    waiter->isDone = true;
+    waiter->value = value;
+    waiter->channel = channel;
+    if (waiter->coroutine != NULL) {
+        waiter->coroutine->home->schedule(waiter->coroutine);
+    }
+    else {
+        waiter->done.notify_one();
+    }
+}
+
+static void wait(std::unique_lock<std::mutex>& lock,
+                 malChannel::Waiter& waiter)
+{
+    if (waiter.coroutine != NULL) {
+        Scheduler::park(lock);
+    }
+    else {
+        waiter.done.wait(lock, [&waiter] { return waiter.isDone; });
+    }
+}
+
+static void checkCanWait()
+{
+    // A parked go block would leave its transaction current on the thread,
+    // and a retried one would repeat its channel operations.
+    MAL_CHECK(Transaction::current() == NULL,
+              "Channel operations can't wait inside dosync");
+}
+
+String malChannel::print(bool readably) const
+{
+    return STRF("#chan(%p)", this);
+}
+
+bool malChannel::tryPut(malValuePtr value, bool& isPut)
+{
+    if (m_isClosed) {
+        isPut = false;
+        return true;
+    }
+    isPut = true;
+    while (!m_takers.empty()) {
+        WaiterPtr taker = m_takers.front();
+        m_takers.pop_front();
+        if (!taker->isDone) {
+            complete(taker, value, this);
+            return true;
+        }
+    }
+    if (m_capacity < 0 || (int)m_buffer.size() < m_capacity) {
+        m_buffer.push_back(value);
+        return true;
+    }
+    return false;
+}
+
+bool malChannel::tryTake(malValuePtr& value)
+{
+    if (!m_buffer.empty()) {
+        value = m_buffer.front();
+        m_buffer.pop_front();
+        // Make room for a waiting putter, if there is one.
+        while (!m_putters.empty()) {
+            auto putter = m_putters.front();
+            m_putters.pop_front();
+            if (!putter.first->isDone) {
+                m_buffer.push_back(putter.second);
+                complete(putter.first, mal::trueValue(), this);
+                break;
+            }
+        }
+        return true;
+    }
+    while (!m_putters.empty()) {
+        auto putter = m_putters.front();
+        m_putters.pop_front();
+        if (!putter.first->isDone) {
+            value = putter.second;
+            complete(putter.first, mal::trueValue(), this);
+            return true;
+        }
+    }
+    if (m_isClosed) {
+        value = mal::nilValue();
+        return true;
+    }
+    return false;
+}
+
+bool malChannel::put(malValuePtr value)
+{
+    MAL_CHECK(value != mal::nilValue(), "Can't put nil on a channel");
+
+    std::unique_lock<std::mutex> lock(s_channelMutex);
+    bool isPut;
+    if (tryPut(value, isPut)) {
+        return isPut;
+    }
+
+    checkCanWait();
+    WaiterPtr waiter = std::make_shared<Waiter>();
+    m_putters.push_back(std::make_pair(waiter, value));
+    wait(lock, *waiter);
+    return waiter->value == mal::trueValue();
+}
+
+malValuePtr malChannel::take()
+{
+    std::unique_lock<std::mutex> lock(s_channelMutex);
+    malValuePtr value;
+    if (tryTake(value)) {
+        return value;
+    }
+
+    checkCanWait();
+    WaiterPtr waiter = std::make_shared<Waiter>();
+    m_takers.push_back(waiter);
+    wait(lock, *waiter);
+    return waiter->value;
+}
+
+void malChannel::close()
+{
+    std::lock_guard<std::mutex> lock(s_channelMutex);
+    m_isClosed = true;
+
+    // Anyone still waiting to take will never get anything. Waiting puts
+    // are left to be taken.
+    for (auto& taker : m_takers) {
+        if (!taker->isDone) {
+            complete(taker, mal::nilValue(), this);
+        }
+    }
+    m_takers.clear();
+}
+
+// Called with the channel lock held.
+void malChannel::forget(const WaiterPtr& waiter)
+{
+    m_takers.erase(std::remove(m_takers.begin(), m_takers.end(), waiter),
+                   m_takers.end());
+    m_putters.erase(std::remove_if(m_putters.begin(), m_putters.end(),
+        [&waiter](const std::pair<WaiterPtr, malValuePtr>& putter) {
+            return putter.first == waiter;
+        }), m_putters.end());
+}
+
+malValueVec malChannel::contents() const
+{
+    std::lock_guard<std::mutex> lock(s_channelMutex);
+    malValueVec contents(m_buffer.begin(), m_buffer.end());
+    for (auto& putter : m_putters) {
+        if (!putter.first->isDone) {
+            contents.push_back(putter.second);
+        }
+    }
+    return contents;
+}
+
+malValuePtr malChannel::alts(malValueIter opsBegin, malValueIter opsEnd)
+{
+    // Validate everything first, so nothing is left half-registered.
+    std::vector<std::pair<malChannel*, malValuePtr>> ops;
+    for (auto it = opsBegin; it != opsEnd; ++it) {
+        if (malChannel* channel = DYNAMIC_CAST(malChannel, *it)) {
+            ops.push_back(std::make_pair(channel, malValuePtr()));
+            continue;
+        }
+        const malVector* put = VALUE_CAST(malVector, *it);
+        MAL_CHECK(put->count() == 2, "alts! puts must be [channel value]");
+        malValuePtr value = put->item(1);
+        MAL_CHECK(value != mal::nilValue(), "Can't put nil on a channel");
+        ops.push_back(std::make_pair(VALUE_CAST(malChannel, put->item(0)),
+                                     value));
+    }
+    MAL_CHECK(!ops.empty(), "alts! needs at least one operation");
+
+    std::unique_lock<std::mutex> lock(s_channelMutex);
+    for (auto& op : ops) {
+        malValuePtr result;
+        bool isDone;
+        if (op.second) {
+            bool isPut;
+            isDone = op.first->tryPut(op.second, isPut);
+            result = mal::boolean(isPut);
+        }
+        else {
+            isDone = op.first->tryTake(result);
+        }
+        if (isDone) {
+            return mal::vector(new malValueVec { result, op.first });
+        }
+    }
+
+    // Wait on all of them. Whichever completes first marks the waiter as
+    // done, and it is then taken off the others, so that a channel which
+    // is rarely used, such as one only closed to quit, doesn't collect
+    // waiters from every alts! it was part of.
+    checkCanWait();
+    WaiterPtr waiter = std::make_shared<Waiter>();
+    for (auto& op : ops) {
+        if (op.second) {
+            op.first->m_putters.push_back(std::make_pair(waiter, op.second));
+        }
+        else {
+            op.first->m_takers.push_back(waiter);
+        }
+    }
+    wait(lock, *waiter);
+    for (auto& op : ops) {
+        op.first->forget(waiter);
+    }
+    return mal::vector(new malValueVec { waiter->value, waiter->channel });
+}
@@ -0,0 +1,17 @@
+#ifndef INCLUDE_CHANNEL_H
+#define INCLUDE_CHANNEL_H
+
+#include "Types.h"
+
+// go blocks run as stackful coroutines on a few scheduler threads. Each
+// stays on the thread it started on, so thread-local state is never seen
+// from the wrong thread, and parks there when a channel operation has to
+// wait. Threads other than the schedulers simply block.
+
+// Runs op in a new go block, returning a channel which receives its result.
+malValuePtr startGoBlock(malValuePtr op);
+
+// True while the calling thread is running a go block.
+bool isInGoBlock();
+
+#endif // INCLUDE_CHANNEL_H
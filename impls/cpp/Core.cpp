@@ -1,11 +1,21 @@
 #include "MAL.h"
+#include "Channel.h"
 #include "Environment.h"
+#include "HeapDump.h"
+#include "Profiler.h"
+#include "STM.h"
+#include "Serialize.h"
+#include "Stats.h"
 #include "StaticList.h"
+#include "ThreadPool.h"
 #include "Types.h"
 
+#include <algorithm>
 #include <chrono>
+#include <cmath>
 #include <fstream>
 #include <iostream>
+#include <memory>
 
 #define CHECK_ARGS_IS(expected) \
     checkArgsIs(name.c_str(), expected, \
@@ -24,6 +34,54 @@ static String printValues(malValueIter begin, malValueIter end,
 
 static StaticList<malBuiltIn*> handlers;
 
+// The environment installCore was called on, which eval evaluates in.
+// Deserialized closures which referred to the global environment refer to
+// this one.
+static malEnvPtr s_globals;
+
+static malValuePtr bench(malValuePtr op, const malHash* options);
+static malValuePtr composeFunctions(malValueIter argsBegin,
+                                    malValueIter argsEnd);
+static const malSequence* sourceSequence(malValuePtr source);
+static malValuePtr transduceToList(malValuePtr xf, malValuePtr source);
+static Transaction* currentTransaction(const String& name);
+static malValuePtr swapAtom(malValuePtr atom, malValuePtr oldValue,
+                            bool returnBoth,
+                            malValueIter opBegin, malValueIter opEnd);
+static void parallelFor(int count, const std::function<void(int, int)>& body);
+static malValuePtr parallelReduce(malValuePtr op, malValuePtr init,
+                                  malValueIter begin, malValueIter end);
+static void writeText(const String& path, const String& text);
+
+class malVectorReducer : public malTransducer::Reducer {
+public:
+    malVectorReducer(malValueVec& items) : m_items(items) { }
+
+    virtual void step(malValuePtr value) { m_items.push_back(value); }
+
+private:
+    malValueVec& m_items;
+};
+
+class malFoldReducer : public malTransducer::Reducer {
+public:
+    malFoldReducer(malValuePtr op, malValuePtr init)
+    : m_op(op), m_args(2) {
+        m_args[0] = init;
+    }
+
+    virtual void step(malValuePtr value) {
+        m_args[1] = value;
+        m_args[0] = APPLY(m_op, m_args.begin(), m_args.end());
+    }
+
+    malValuePtr result() const { return m_args[0]; }
+
+private:
+    malValuePtr m_op;
+    malValueVec m_args;
+};
+
 #define ARG(type, name) type* name = VALUE_CAST(type, *argsBegin++)
 
 #define FUNCNAME(uniq) builtIn ## uniq
@@ -61,6 +119,7 @@ static StaticList<malBuiltIn*> handlers;
     }
 
 BUILTIN_ISA("atom?",        malAtom);
+BUILTIN_ISA("future?",      malFuture);
 BUILTIN_ISA("keyword?",     malKeyword);
 BUILTIN_ISA("list?",        malList);
 BUILTIN_ISA("map?",         malHash);
@@ -136,21 +195,77 @@ BUILTIN("=")
     return mal::boolean(lhs->isEqualTo(rhs));
 }
 
+BUILTIN(">!")
+{
+    CHECK_ARGS_IS(2);
+    ARG(malChannel, channel);
+    return mal::boolean(channel->put(*argsBegin));
+}
+
+BUILTIN("<!")
+{
+    CHECK_ARGS_IS(1);
+    ARG(malChannel, channel);
+    return channel->take();
+}
+
+BUILTIN("alloc-profile-report")
+{
+    int argCount = CHECK_ARGS_BETWEEN(0, 1);
+    if (argCount == 0) {
+        return mal::string(AllocationProfiler::report(s_globals));
+    }
+    ARG(malString, filename);
+
+    writeText(filename->value(), AllocationProfiler::report(s_globals));
+    return mal::nilValue();
+}
+
+BUILTIN("alloc-profile-start")
+{
+    CHECK_ARGS_IS(0);
+    AllocationProfiler::start();
+    return mal::nilValue();
+}
+
+BUILTIN("alloc-profile-stop")
+{
+    CHECK_ARGS_IS(0);
+    AllocationProfiler::stop();
+    return mal::nilValue();
+}
+
+BUILTIN("alter")
+{
+    CHECK_ARGS_AT_LEAST(2);
+    ARG(malRef, ref);
+    Transaction* tx = currentTransaction(name);
+
+    malValueVec call(argsBegin, argsEnd);
+    call.insert(call.begin() + 1, tx->read(ref));
+    return tx->set(ref, APPLY(call[0], call.begin() + 1, call.end()));
+}
+
+BUILTIN("alts!")
+{
+    CHECK_ARGS_IS(1);
+    ARG(malSequence, ops);
+    return malChannel::alts(ops->begin(), ops->end());
+}
+
 BUILTIN("apply")
 {
     CHECK_ARGS_AT_LEAST(2);
-    malValuePtr op = *argsBegin++; // this gets checked in APPLY
 
-    // Copy the first N-1 arguments in.
-    malValueVec args(argsBegin, argsEnd-1);
+    // Copy the function and the first N-1 arguments in.
+    malValueVec call(argsBegin, argsEnd-1);
 
     // Then append the argument as a list.
     const malSequence* lastArg = VALUE_CAST(malSequence, *(argsEnd-1));
-    for (int i = 0; i < lastArg->count(); i++) {
-        args.push_back(lastArg->item(i));
-    }
+    call.insert(call.end(), lastArg->begin(), lastArg->end());
 
-    return APPLY(op, args.begin(), args.end());
+    // The function gets checked when the tail call is applied.
+    return mal::tailCall(std::move(call));
 }
 
 BUILTIN("assoc")
@@ -168,6 +283,78 @@ BUILTIN("atom")
     return mal::atom(*argsBegin);
 }
 
+BUILTIN("atom-stats")
+{
+    CHECK_ARGS_IS(1);
+    ARG(malAtom, atom);
+
+    malValueVec stats;
+    stats.push_back(mal::keyword(":retries"));
+    stats.push_back(mal::integer(atom->retries()));
+    stats.push_back(mal::keyword(":contention"));
+    stats.push_back(mal::integer(atom->contention()));
+    return mal::hash(stats.begin(), stats.end(), true);
+}
+
+BUILTIN("bench")
+{
+    int argCount = CHECK_ARGS_BETWEEN(1, 2);
+    malValuePtr op = *argsBegin++;
+    if (argCount == 1) {
+        return bench(op, NULL);
+    }
+    ARG(malHash, options);
+    return bench(op, options);
+}
+
+BUILTIN("chan")
+{
+    int argCount = CHECK_ARGS_BETWEEN(0, 1);
+    if (argCount == 0) {
+        return mal::channel(0);
+    }
+    if (const malKeyword* kw = DYNAMIC_CAST(malKeyword, *argsBegin)) {
+        MAL_CHECK(kw->value() == ":unbounded",
+                  "chan expects a buffer size or :unbounded");
+        return mal::channel(-1);
+    }
+    ARG(malInteger, size);
+    MAL_CHECK(size->value() >= 0, "chan buffer size can't be negative");
+    return mal::channel(size->value());
+}
+
+BUILTIN("close!")
+{
+    CHECK_ARGS_IS(1);
+    ARG(malChannel, channel);
+    channel->close();
+    return mal::nilValue();
+}
+
+BUILTIN("commute")
+{
+    CHECK_ARGS_AT_LEAST(2);
+    ARG(malRef, ref);
+    return currentTransaction(name)->commute(ref, argsBegin, argsEnd);
+}
+
+BUILTIN("comp")
+{
+    CHECK_ARGS_AT_LEAST(1);
+    if (DYNAMIC_CAST(malTransducer, *argsBegin)) {
+        return malTransducer::compose(argsBegin, argsEnd);
+    }
+    return composeFunctions(argsBegin, argsEnd);
+}
+
+BUILTIN("compare-and-set!")
+{
+    CHECK_ARGS_IS(3);
+    ARG(malAtom, atom);
+    malValuePtr oldValue = *argsBegin++;
+    return mal::boolean(atom->compareAndSet(oldValue, *argsBegin));
+}
+
 BUILTIN("concat")
 {
     int count = 0;
@@ -229,14 +416,53 @@ BUILTIN("count")
     return mal::integer(seq->count());
 }
 
+BUILTIN("deliver")
+{
+    CHECK_ARGS_IS(2);
+    malValuePtr promise = *argsBegin;
+    ARG(malPromise, p);
+
+    return p->deliver(*argsBegin) ? promise : mal::nilValue();
+}
+
 BUILTIN("deref")
 {
-    CHECK_ARGS_IS(1);
-    ARG(malAtom, atom);
+    int argCount = CHECK_ARGS_BETWEEN(1, 3);
+    MAL_CHECK(argCount != 2, "deref expects 1 or 3 arguments");
 
+    if (malPromise* p = DYNAMIC_CAST(malPromise, *argsBegin)) {
+        if (argCount == 1) {
+            return p->deref();
+        }
+        ++argsBegin;
+        ARG(malInteger, timeout);
+        malValuePtr value = p->deref(std::max<int64_t>(timeout->value(), 0));
+        return value ? value : *argsBegin;
+    }
+
+    MAL_CHECK(argCount == 1, "deref with a timeout expects a future or promise");
+    if (malRef* ref = DYNAMIC_CAST(malRef, *argsBegin)) {
+        return ref->deref();
+    }
+    ARG(malAtom, atom);
     return atom->deref();
 }
 
+BUILTIN("deserialize")
+{
+    CHECK_ARGS_IS(1);
+    ARG(malString, data);
+    const String& bytes = data->value();
+    return deserialize(bytes.data(), bytes.size(), s_globals);
+}
+
+BUILTIN("deserialize-file")
+{
+    CHECK_ARGS_IS(1);
+    ARG(malString, filename);
+    return deserializeFile(filename->value(), s_globals);
+}
+
 BUILTIN("dissoc")
 {
     CHECK_ARGS_AT_LEAST(1);
@@ -245,6 +471,12 @@ BUILTIN("dissoc")
     return hash->dissoc(argsBegin, argsEnd);
 }
 
+BUILTIN("dosync-call")
+{
+    CHECK_ARGS_IS(1);
+    return Transaction::run(*argsBegin); // this gets checked in APPLY
+}
+
 BUILTIN("empty?")
 {
     CHECK_ARGS_IS(1);
@@ -253,10 +485,24 @@ BUILTIN("empty?")
     return mal::boolean(seq->isEmpty());
 }
 
+BUILTIN("ensure")
+{
+    CHECK_ARGS_IS(1);
+    ARG(malRef, ref);
+    return currentTransaction(name)->ensure(ref);
+}
+
 BUILTIN("eval")
 {
     CHECK_ARGS_IS(1);
-    return EVAL(*argsBegin, NULL);
+    return EVAL(*argsBegin, s_globals);
+}
+
+BUILTIN("filter")
+{
+    int argCount = CHECK_ARGS_BETWEEN(1, 2);
+    malValuePtr xf = mal::transducer(malTransducer::FILTER, *argsBegin++);
+    return argCount == 1 ? xf : transduceToList(xf, *argsBegin);
 }
 
 BUILTIN("first")
@@ -269,6 +515,12 @@ BUILTIN("first")
     return seq->first();
 }
 
+BUILTIN("flight-recorder-dump")
+{
+    CHECK_ARGS_IS(0);
+    return mal::string(FlightRecorder::dump("requested"));
+}
+
 BUILTIN("fn?")
 {
     CHECK_ARGS_IS(1);
@@ -278,8 +530,14 @@ BUILTIN("fn?")
     if (const malLambda* lambda = DYNAMIC_CAST(malLambda, arg)) {
         return mal::boolean(!lambda->isMacro());
     }
-    // Builtins are functions.
-    return mal::boolean(DYNAMIC_CAST(malBuiltIn, arg));
+    // Builtins and memoized functions are functions.
+    return mal::boolean(DYNAMIC_CAST(malApplicable, arg));
+}
+
+BUILTIN("future-call")
+{
+    CHECK_ARGS_IS(1);
+    return mal::future(*argsBegin); // this gets checked in APPLY
 }
 
 BUILTIN("get")
@@ -292,11 +550,62 @@ BUILTIN("get")
     return hash->get(*argsBegin);
 }
 
+BUILTIN("go-call")
+{
+    CHECK_ARGS_IS(1);
+    return startGoBlock(*argsBegin); // this gets checked in APPLY
+}
+
 BUILTIN("hash-map")
 {
     return mal::hash(argsBegin, argsEnd, true);
 }
 
+BUILTIN("heap-dump")
+{
+    int argCount = CHECK_ARGS_BETWEEN(0, 1);
+    size_t objectCount;
+    if (argCount == 0) {
+        return mal::string(HeapDump::write(s_globals, objectCount));
+    }
+    ARG(malString, filename);
+
+    writeText(filename->value(), HeapDump::write(s_globals, objectCount));
+    return mal::integer(objectCount);
+}
+
+BUILTIN("into")
+{
+    int argCount = CHECK_ARGS_BETWEEN(2, 3);
+    malValuePtr to = *argsBegin++;
+    malValuePtr xf = (argCount == 3) ? *argsBegin++ : malValuePtr();
+    const malSequence* source = sourceSequence(*argsBegin);
+
+    malValueVec items;
+    if (xf) {
+        const malTransducer* transducer = VALUE_CAST(malTransducer, xf);
+        malVectorReducer reducer(items);
+        transducer->reduce(source->begin(), source->end(), reducer);
+    }
+    else {
+        items.assign(source->begin(), source->end());
+    }
+
+    if (const malHash* hash = DYNAMIC_CAST(malHash, to)) {
+        malValueVec pairs;
+        pairs.reserve(items.size() * 2);
+        for (auto it = items.begin(), end = items.end(); it != end; ++it) {
+            const malSequence* pair = VALUE_CAST(malSequence, *it);
+            MAL_CHECK(pair->count() == 2, "into expects key/value pairs");
+            pairs.push_back(pair->item(0));
+            pairs.push_back(pair->item(1));
+        }
+        return hash->assoc(pairs.begin(), pairs.end());
+    }
+    const malSequence* seq = VALUE_CAST(malSequence, to);
+    return seq->conj(items.begin(), items.end());
+}
+
 BUILTIN("keys")
 {
     CHECK_ARGS_IS(1);
@@ -331,9 +640,12 @@ BUILTIN("macro?")
 
 BUILTIN("map")
 {
-    CHECK_ARGS_IS(2);
+    int argCount = CHECK_ARGS_BETWEEN(1, 2);
     malValuePtr op = *argsBegin++; // this gets checked in APPLY
-    ARG(malSequence, source);
+    if (argCount == 1) {
+        return mal::transducer(malTransducer::MAP, op);
+    }
+    const malSequence* source = sourceSequence(*argsBegin);
 
     const int length = source->count();
     malValueVec* items = new malValueVec(length);
@@ -345,6 +657,18 @@ BUILTIN("map")
     return  mal::list(items);
 }
 
+BUILTIN("memoize")
+{
+    int argCount = CHECK_ARGS_BETWEEN(1, 2);
+    malValuePtr op = *argsBegin++; // this gets checked in APPLY
+    if (argCount == 1) {
+        return mal::memoize(op, 0);
+    }
+    ARG(malInteger, limit);
+    MAL_CHECK(limit->value() > 0, "memoize limit must be positive");
+    return mal::memoize(op, limit->value());
+}
+
 BUILTIN("meta")
 {
     CHECK_ARGS_IS(1);
@@ -353,6 +677,12 @@ BUILTIN("meta")
     return obj->meta();
 }
 
+BUILTIN("metrics")
+{
+    CHECK_ARGS_IS(0);
+    return mal::string(RuntimeStats::metrics());
+}
+
 BUILTIN("nth")
 {
     CHECK_ARGS_IS(2);
@@ -365,11 +695,74 @@ BUILTIN("nth")
     return seq->item(i);
 }
 
+BUILTIN("partition")
+{
+    int argCount = CHECK_ARGS_BETWEEN(1, 2);
+    ARG(malInteger, size);
+    MAL_CHECK(size->value() > 0, "Partition size must be positive");
+
+    malValuePtr xf = mal::transducer(malTransducer::PARTITION, size->value());
+    return argCount == 1 ? xf : transduceToList(xf, *argsBegin);
+}
+
+BUILTIN("pfilter")
+{
+    CHECK_ARGS_IS(2);
+    malValuePtr op = *argsBegin++; // this gets checked in APPLY
+    const malSequence* source = sourceSequence(*argsBegin);
+
+    const int length = source->count();
+    std::vector<char> keep(length);
+    malValueIter in = source->begin();
+    parallelFor(length, [&](int begin, int end) {
+        for (int i = begin; i < end; i++) {
+            keep[i] = APPLY(op, in+i, in+i+1)->isTrue();
+        }
+    });
+
+    malValueVec* items = new malValueVec();
+    for (int i = 0; i < length; i++) {
+        if (keep[i]) {
+            items->push_back(in[i]);
+        }
+    }
+    return mal::list(items);
+}
+
+BUILTIN("pmap")
+{
+    CHECK_ARGS_IS(2);
+    malValuePtr op = *argsBegin++; // this gets checked in APPLY
+    const malSequence* source = sourceSequence(*argsBegin);
+
+    const int length = source->count();
+    std::unique_ptr<malValueVec> items(new malValueVec(length));
+    malValueIter in = source->begin();
+    malValueIter out = items->begin();
+    parallelFor(length, [&](int begin, int end) {
+        for (int i = begin; i < end; i++) {
+            out[i] = APPLY(op, in+i, in+i+1);
+        }
+    });
+
+    return mal::list(items.release());
+}
+
 BUILTIN("pr-str")
 {
     return mal::string(printValues(argsBegin, argsEnd, " ", true));
 }
 
+BUILTIN("preduce")
+{
+    CHECK_ARGS_IS(3);
+    malValuePtr op = *argsBegin++; // this gets checked in APPLY
+    malValuePtr init = *argsBegin++;
+    const malSequence* source = sourceSequence(*argsBegin);
+
+    return parallelReduce(op, init, source->begin(), source->end());
+}
+
 BUILTIN("println")
 {
     std::cout << printValues(argsBegin, argsEnd, " ", false) << "\n";
@@ -382,6 +775,47 @@ BUILTIN("prn")
     return mal::nilValue();
 }
 
+BUILTIN("profile-start")
+{
+    int argCount = CHECK_ARGS_BETWEEN(0, 1);
+    int64_t samplesPerSecond = 1000;
+    if (argCount == 1) {
+        ARG(malInteger, rate);
+        samplesPerSecond = rate->value();
+    }
+    MAL_CHECK((samplesPerSecond > 0) && (samplesPerSecond <= 10000),
+              "The sampling rate must be between 1 and 10000 per second");
+    Profiler::start((int)samplesPerSecond);
+    return mal::nilValue();
+}
+
+BUILTIN("profile-stop")
+{
+    int argCount = CHECK_ARGS_BETWEEN(0, 1);
+    int sampleCount;
+    if (argCount == 0) {
+        return mal::string(Profiler::stop(s_globals, sampleCount));
+    }
+    ARG(malString, filename);
+
+    writeText(filename->value(), Profiler::stop(s_globals, sampleCount));
+    return mal::integer(sampleCount);
+}
+
+BUILTIN("promise")
+{
+    CHECK_ARGS_IS(0);
+    return mal::promise();
+}
+
+BUILTIN("read-file")
+{
+    CHECK_ARGS_IS(1);
+    ARG(malString, filename);
+
+    return readFile(filename->value());
+}
+
 BUILTIN("read-string")
 {
     CHECK_ARGS_IS(1);
@@ -398,6 +832,26 @@ BUILTIN("readline")
     return readline(str->value());
 }
 
+BUILTIN("realized?")
+{
+    CHECK_ARGS_IS(1);
+    ARG(malPromise, p);
+    return mal::boolean(p->isRealized());
+}
+
+BUILTIN("ref")
+{
+    CHECK_ARGS_IS(1);
+    return mal::ref(*argsBegin);
+}
+
+BUILTIN("ref-set")
+{
+    CHECK_ARGS_IS(2);
+    ARG(malRef, ref);
+    return currentTransaction(name)->set(ref, *argsBegin);
+}
+
 BUILTIN("reset!")
 {
     CHECK_ARGS_IS(2);
@@ -415,6 +869,19 @@ BUILTIN("rest")
     return seq->rest();
 }
 
+BUILTIN("runtime-stats")
+{
+    CHECK_ARGS_IS(0);
+    return RuntimeStats::report();
+}
+
+BUILTIN("runtime-stats-reset")
+{
+    CHECK_ARGS_IS(0);
+    RuntimeStats::reset();
+    return mal::nilValue();
+}
+
 BUILTIN("seq")
 {
     CHECK_ARGS_IS(1);
@@ -441,11 +908,25 @@ BUILTIN("seq")
     MAL_FAIL("%s is not a string or sequence", arg->print(true).c_str());
 }
 
+BUILTIN("serialize")
+{
+    CHECK_ARGS_IS(1);
+    return mal::string(serialize(*argsBegin));
+}
+
+BUILTIN("serialize-file")
+{
+    CHECK_ARGS_IS(2);
+    ARG(malString, filename);
+    serializeFile(filename->value(), *argsBegin);
+    return mal::nilValue();
+}
 
 BUILTIN("slurp")
 {
     CHECK_ARGS_IS(1);
     ARG(malString, filename);
+    Tracer::Scope scope("io", "slurp", filename->value());
 
     std::ios_base::openmode openmode =
         std::ios::ate | std::ios::in | std::ios::binary;
@@ -469,16 +950,17 @@ BUILTIN("str")
 BUILTIN("swap!")
 {
     CHECK_ARGS_AT_LEAST(2);
-    ARG(malAtom, atom);
-
-    malValuePtr op = *argsBegin++; // this gets checked in APPLY
-
-    malValueVec args(1 + argsEnd - argsBegin);
-    args[0] = atom->deref();
-    std::copy(argsBegin, argsEnd, args.begin() + 1);
+    malValuePtr atom = *argsBegin;
+    ARG(malAtom, a);
+    return swapAtom(atom, a->deref(), false, argsBegin, argsEnd);
+}
 
-    malValuePtr value = APPLY(op, args.begin(), args.end());
-    return atom->reset(value);
+BUILTIN("swap-vals!")
+{
+    CHECK_ARGS_AT_LEAST(2);
+    malValuePtr atom = *argsBegin;
+    ARG(malAtom, a);
+    return swapAtom(atom, a->deref(), true, argsBegin, argsEnd);
 }
 
 BUILTIN("symbol")
@@ -488,9 +970,20 @@ BUILTIN("symbol")
     return mal::symbol(token->value());
 }
 
+BUILTIN("take")
+{
+    int argCount = CHECK_ARGS_BETWEEN(1, 2);
+    ARG(malInteger, count);
+
+    malValuePtr xf = mal::transducer(malTransducer::TAKE, count->value());
+    return argCount == 1 ? xf : transduceToList(xf, *argsBegin);
+}
+
 BUILTIN("throw")
 {
     CHECK_ARGS_IS(1);
+    RuntimeStats::count(RuntimeStats::ExceptionsThrown);
+    FlightRecorder::noteThrow(typeid(*(*argsBegin).ptr()));
     throw *argsBegin;
 }
 
@@ -506,6 +999,41 @@ BUILTIN("time-ms")
     return mal::integer(ms.count());
 }
 
+BUILTIN("trace-start")
+{
+    CHECK_ARGS_IS(0);
+    Tracer::start();
+    return mal::nilValue();
+}
+
+BUILTIN("trace-stop")
+{
+    int argCount = CHECK_ARGS_BETWEEN(0, 1);
+    if (argCount == 0) {
+        return mal::string(Tracer::stop(s_globals));
+    }
+    ARG(malString, filename);
+
+    writeText(filename->value(), Tracer::stop(s_globals));
+    return mal::nilValue();
+}
+
+// With no init, as in Clojure, it is what op returns when given no
+// arguments.
+BUILTIN("transduce")
+{
+    int argCount = CHECK_ARGS_BETWEEN(3, 4);
+    ARG(malTransducer, xf);
+    malValuePtr op = *argsBegin++; // this gets checked in APPLY
+    malValuePtr init = argCount == 4 ? *argsBegin++
+                                     : APPLY(op, argsEnd, argsEnd);
+    const malSequence* source = sourceSequence(*argsBegin);
+
+    malFoldReducer reducer(op, init);
+    xf->reduce(source->begin(), source->end(), reducer);
+    return reducer.result();
+}
+
 BUILTIN("vals")
 {
     CHECK_ARGS_IS(1);
@@ -534,12 +1062,187 @@ BUILTIN("with-meta")
 }
 
 void installCore(malEnvPtr env) {
+    s_globals = env;
     for (auto it = handlers.begin(), end = handlers.end(); it != end; ++it) {
         malBuiltIn* handler = *it;
         env->set(handler->name(), handler);
     }
 }
 
+malValuePtr findBuiltIn(const String& name)
+{
+    for (auto it = handlers.begin(), end = handlers.end(); it != end; ++it) {
+        if ((*it)->name() == name) {
+            return *it;
+        }
+    }
+    return NULL;
+}
+
+// (comp f g h) is (fn* [& args] (f (g (apply h args)))), closing over the
+// functions in an environment of its own, so that it can be serialized
+// like any other closure. Functions may not be mixed with transducers.
+static malValuePtr composeFunctions(malValueIter argsBegin,
+                                    malValueIter argsEnd)
+{
+    malEnvPtr env(new malEnv);
+    env->set("apply", findBuiltIn("apply"));
+    const int count = argsEnd - argsBegin;
+    malValuePtr body = mal::list(mal::symbol("apply"),
+                                 mal::symbol(STRF("f%d", count - 1)),
+                                 mal::symbol("args"));
+    for (int i = count - 1; i >= 0; i--) {
+        malValuePtr op = argsBegin[i];
+        MAL_CHECK(!DYNAMIC_CAST(malTransducer, op),
+                  "comp can't mix transducers with functions");
+        env->set(STRF("f%d", i), op);
+        if (i < count - 1) {
+            body = mal::list(mal::symbol(STRF("f%d", i)), body);
+        }
+    }
+    return mal::lambda(StringVec { "&", "args" }, body, env);
+}
+
+// nil is an empty source, as in Clojure.
+static const malSequence* sourceSequence(malValuePtr source)
+{
+    static const malValuePtr empty = mal::list(new malValueVec);
+    return VALUE_CAST(malSequence,
+                      source == mal::nilValue() ? empty : source);
+}
+
+static malValuePtr transduceToList(malValuePtr xf, malValuePtr source)
+{
+    const malSequence* seq = sourceSequence(source);
+
+    std::unique_ptr<malValueVec> items(new malValueVec);
+    malVectorReducer reducer(*items);
+    STATIC_CAST(malTransducer, xf)->reduce(seq->begin(), seq->end(), reducer);
+    return mal::list(items.release());
+}
+
+// swap! and swap-vals! finish with this. It is passed the atom, the value
+// the update started from, whether to return both values, and the update
+// function with its arguments, followed by the new value. If the atom
+// changed in the meantime, the update is retried.
+static malValuePtr swapCommit(const String& name,
+                              malValueIter argsBegin, malValueIter argsEnd)
+{
+    malValuePtr atom = *argsBegin;
+    ARG(malAtom, a);
+    malValuePtr oldValue = *argsBegin++;
+    bool returnBoth = *argsBegin++ == mal::trueValue();
+    malValuePtr newValue = *--argsEnd;
+
+    if (a->compareAndSet(oldValue, newValue)) {
+        if (!returnBoth) {
+            return newValue;
+        }
+        malValueVec* items = new malValueVec(2);
+        (*items)[0] = oldValue;
+        (*items)[1] = newValue;
+        return mal::vector(items);
+    }
+
+    a->noteRetry();
+    return swapAtom(atom, a->deref(), returnBoth, argsBegin, argsEnd);
+}
+
+static malValuePtr swapAtom(malValuePtr atom, malValuePtr oldValue,
+                            bool returnBoth,
+                            malValueIter opBegin, malValueIter opEnd)
+{
+    static const malValuePtr commit = mal::builtin("swap!", &swapCommit);
+
+    // Apply the function in tail position, then commit its result.
+    malValueVec call(1 + opEnd - opBegin);
+    call[0] = *opBegin; // this gets checked when the call is applied
+    call[1] = oldValue;
+    std::copy(opBegin + 1, opEnd, call.begin() + 2);
+
+    malValueVec then;
+    then.reserve(3 + opEnd - opBegin);
+    then.push_back(commit);
+    then.push_back(atom);
+    then.push_back(oldValue);
+    then.push_back(mal::boolean(returnBoth));
+    then.insert(then.end(), opBegin, opEnd);
+    return mal::tailCall(std::move(call), std::move(then));
+}
+
+static Transaction* currentTransaction(const String& name)
+{
+    Transaction* tx = Transaction::current();
+    MAL_CHECK(tx != NULL, "%s called outside of dosync", name.c_str());
+    return tx;
+}
+
+// Work is split into a few chunks per thread, so that stealing can even
+// out any imbalance between them.
+static int chunkSize(int count)
+{
+    return std::max(1, count / (4 * (ThreadPool::instance().size() + 1)));
+}
+
+static void parallelFor(int count, const std::function<void(int, int)>& body)
+{
+    ThreadPool& pool = ThreadPool::instance();
+    const int chunk = chunkSize(count);
+
+    TaskGroup group;
+    for (int begin = 0; begin < count; begin += chunk) {
+        int end = std::min(count, begin + chunk);
+        pool.spawn(group, [&body, begin, end] { body(begin, end); });
+    }
+    pool.wait(group);
+}
+
+static malValuePtr reduceRange(malValuePtr op, malValuePtr init,
+                               malValueIter begin, malValueIter end, int grain)
+{
+    malValueVec args(2);
+    if (end - begin <= grain) {
+        args[0] = init;
+        for (auto it = begin; it != end; ++it) {
+            args[1] = *it;
+            args[0] = APPLY(op, args.begin(), args.end());
+        }
+        return args[0];
+    }
+
+    // Fork the left half, and do the right half ourselves.
+    ThreadPool& pool = ThreadPool::instance();
+    malValueIter middle = begin + (end - begin) / 2;
+    TaskGroup group;
+    pool.spawn(group, [&] {
+        args[0] = reduceRange(op, init, begin, middle, grain);
+    });
+
+    // The left half refers to this frame, so it must finish even if the
+    // right half fails.
+    std::exception_ptr error;
+    try {
+        args[1] = reduceRange(op, init, middle, end, grain);
+    }
+    catch (...) {
+        error = std::current_exception();
+    }
+    pool.wait(group);
+    if (error) {
+        std::rethrow_exception(error);
+    }
+
+    return APPLY(op, args.begin(), args.end());
+}
+
+// op must be associative, and init its identity, as each chunk of the
+// sequence is reduced from init, and the results combined with op.
+static malValuePtr parallelReduce(malValuePtr op, malValuePtr init,
+                                  malValueIter begin, malValueIter end)
+{
+    return reduceRange(op, init, begin, end, chunkSize(end - begin));
+}
+
 static String printValues(malValueIter begin, malValueIter end,
                           const String& sep, bool readably)
 {
@@ -557,3 +1260,127 @@ static String printValues(malValueIter begin, malValueIter end,
 
     return out;
 }
+
+static int64_t benchOption(const malHash* options, const char* key,
+                           int64_t defaultValue)
+{
+    malValuePtr value = options != NULL ? options->get(mal::keyword(key))
+                                        : mal::nilValue();
+    if (value == mal::nilValue()) {
+        return defaultValue;
+    }
+    int64_t n = VALUE_CAST(malInteger, value)->value();
+    MAL_CHECK(n > 0, "bench's %s must be positive", key);
+    return n;
+}
+
+// Calls op with no arguments in batches. Warming up doubles the batch size
+// until a batch takes the time wanted of a sample, unless the options give
+// the number of iterations. Calls which take long enough for reading the
+// clock not to distort them are then timed one by one, so the spread
+// returned is that of single calls. Quicker ones are timed a batch at a
+// time, and the times returned, in nanoseconds, are of the batches' means.
+static malValuePtr bench(malValuePtr op, const malHash* options)
+{
+    using namespace std::chrono;
+    const int64_t warmupNanos = benchOption(options, ":warmup-ms", 200) *
+                                1000000;
+    const int64_t sampleNanos = benchOption(options, ":sample-ms", 10) *
+                                1000000;
+    const int64_t sampleCount = benchOption(options, ":samples", 100);
+    int64_t iterations = benchOption(options, ":iterations", 0);
+
+    malValueVec noArgs;
+    auto runBatch = [&](int64_t count) {
+        steady_clock::time_point start = steady_clock::now();
+        for (int64_t i = 0; i < count; i++) {
+            APPLY(op, noArgs.begin(), noArgs.end());
+        }
+        return duration_cast<nanoseconds>(steady_clock::now() - start)
+            .count();
+    };
+
+    int64_t batch = 1, warmedNanos = 0, lastNanos, lastBatch;
+    do {
+        int64_t nanos = runBatch(batch);
+        warmedNanos += nanos;
+        lastNanos = nanos;
+        lastBatch = batch;
+        if (iterations == 0 && nanos >= sampleNanos) {
+            iterations = std::max<int64_t>(1, batch * sampleNanos / nanos);
+        }
+        else if (iterations == 0) {
+            batch *= 2;
+        }
+    } while (warmedNanos < warmupNanos);
+    if (iterations == 0) {
+        iterations = batch;
+    }
+
+    // Reading the clock must cost under 1% of a call timed on its own.
+    const int clockReads = 1000;
+    steady_clock::time_point clockStart = steady_clock::now();
+    for (int i = 1; i < clockReads; i++) {
+        steady_clock::now();
+    }
+    const int64_t clockNanos = duration_cast<nanoseconds>(
+        steady_clock::now() - clockStart).count() / clockReads;
+    const bool isTimedSingly = lastNanos >= 100 * clockNanos * lastBatch;
+
+    uint64_t objectsBefore, bytesBefore, objectsAfter, bytesAfter;
+    RuntimeStats::threadAllocations(objectsBefore, bytesBefore);
+    std::vector<double> times;
+    for (int64_t i = 0; i < sampleCount; i++) {
+        if (!isTimedSingly) {
+            times.push_back((double)runBatch(iterations) / iterations);
+            continue;
+        }
+        for (int64_t j = 0; j < iterations; j++) {
+            times.push_back((double)runBatch(1));
+        }
+    }
+    RuntimeStats::threadAllocations(objectsAfter, bytesAfter);
+    std::sort(times.begin(), times.end());
+
+    const size_t timeCount = times.size();
+    double sum = 0;
+    for (double t : times) {
+        sum += t;
+    }
+    double mean = sum / timeCount;
+    double squares = 0;
+    for (double t : times) {
+        squares += (t - mean) * (t - mean);
+    }
+    const int64_t calls = sampleCount * iterations;
+    const size_t p99 = (timeCount * 99 + 99) / 100 - 1;
+
+    malValueVec stats;
+    auto add = [&](const char* key, int64_t value) {
+        stats.push_back(mal::keyword(key));
+        stats.push_back(mal::integer(value));
+    };
+    add(":samples", sampleCount);
+    add(":iterations", iterations);
+    stats.push_back(mal::keyword(":timed-singly"));
+    stats.push_back(mal::boolean(isTimedSingly));
+    add(":min-ns", llround(times.front()));
+    add(":median-ns", llround(times[(timeCount - 1) / 2]));
+    add(":mean-ns", llround(mean));
+    add(":p99-ns", llround(times[p99]));
+    add(":stddev-ns", llround(sqrt(squares / timeCount)));
+    add(":allocations", llround((double)(objectsAfter - objectsBefore) /
+                                calls));
+    add(":allocated-bytes", llround((double)(bytesAfter - bytesBefore) /
+                                    calls));
+    return mal::hash(stats.begin(), stats.end(), true);
+}
+
+static void writeText(const String& path, const String& text)
+{
+    std::ofstream file(path.c_str(),
+                       std::ios::out | std::ios::binary | std::ios::trunc);
+    MAL_CHECK(!file.fail(), "Cannot open %s", path.c_str());
+    file << text;
+    MAL_CHECK(!file.fail(), "Cannot write %s", path.c_str());
+}
@@ -1,6 +1,8 @@
 #ifndef INCLUDE_DEBUG_H
 #define INCLUDE_DEBUG_H
 
+#include "FlightRecorder.h"
+
 #include <stdio.h>
 #include <stdlib.h>
 
@@ -35,6 +37,8 @@
     if (!(condition)) { \
         printf("Assertion failed at %s(%d): ", file, line); \
         printf(__VA_ARGS__); \
+        fflush(stdout); \
+        FlightRecorder::dump(fileno(stderr), "assertion failed"); \
         exit(1); \
     } else { }
 
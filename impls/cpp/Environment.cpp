@@ -1,19 +1,25 @@
 #include "Environment.h"
+#include "Stats.h"
 #include "Types.h"
 
 #include <algorithm>
+#include <mutex>
 
 malEnv::malEnv(malEnvPtr outer)
-: m_outer(outer)
+: m_published(NULL)
+, m_outer(outer)
 {
     TRACE_ENV("Creating malEnv %p, outer=%p\n", this, m_outer.ptr());
+    RuntimeStats::count(RuntimeStats::EnvsCreated);
 }
 
 malEnv::malEnv(malEnvPtr outer, const StringVec& bindings,
                malValueIter argsBegin, malValueIter argsEnd)
-: m_outer(outer)
+: m_published(NULL)
+, m_outer(outer)
 {
     TRACE_ENV("Creating malEnv %p, outer=%p\n", this, m_outer.ptr());
+    RuntimeStats::count(RuntimeStats::EnvsCreated);
     int n = bindings.size();
     auto it = argsBegin;
     for (int i = 0; i < n; i++) {
@@ -33,12 +39,16 @@ malEnv::malEnv(malEnvPtr outer, const StringVec& bindings,
 malEnv::~malEnv()
 {
     TRACE_ENV("Destroying malEnv %p, outer=%p\n", this, m_outer.ptr());
+    delete m_published.load(std::memory_order_relaxed);
 }
 
+// The chain is walked with plain pointers, which this environment keeps
+// alive, to save reference counting at each step.
 malEnvPtr malEnv::find(const String& symbol)
 {
-    for (malEnvPtr env = this; env; env = env->m_outer) {
-        if (env->m_map.find(symbol) != env->m_map.end()) {
+    for (malEnv* env = this; env; env = env->m_outer.ptr()) {
+        const Map& map = env->bindings();
+        if (map.find(symbol) != map.end()) {
             return env;
         }
     }
@@ -47,25 +57,74 @@ malEnvPtr malEnv::find(const String& symbol)
 
 malValuePtr malEnv::get(const String& symbol)
 {
-    for (malEnvPtr env = this; env; env = env->m_outer) {
-        auto it = env->m_map.find(symbol);
-        if (it != env->m_map.end()) {
+    malValuePtr value = lookup(symbol);
+    MAL_CHECK(value, "'%s' not found", symbol.c_str());
+    return value;
+}
+
+malValuePtr malEnv::lookup(const String& symbol)
+{
+    int depth = 0;
+    for (malEnv* env = this; env; env = env->m_outer.ptr(), depth++) {
+        const Map& map = env->bindings();
+        auto it = map.find(symbol);
+        if (it != map.end()) {
+            RuntimeStats::countLookup(depth);
             return it->second;
         }
     }
-    MAL_FAIL("'%s' not found", symbol.c_str());
+    return NULL;
 }
 
 malValuePtr malEnv::set(const String& symbol, malValuePtr value)
 {
+    if (m_published.load(std::memory_order_relaxed) != NULL) {
+        return define(symbol, value);
+    }
     m_map[symbol] = value;
     return value;
 }
 
+// Bindings which were replaced while tasks may still have been reading
+// them, to be freed once no task is running.
+static std::mutex s_retiredMutex;
+static std::vector<malEnv::Map*> s_retired;
+
+// Only threads outside of tasks may define, so while no task is running
+// there are no other readers, and the bindings are changed in place.
+// Otherwise the change is made to a copy, which is published in place of
+// the bindings, which are kept until then.
+malValuePtr malEnv::define(const String& symbol, malValuePtr value)
+{
+    std::lock_guard<std::mutex> lock(s_retiredMutex);
+    Map* published = m_published.load(std::memory_order_relaxed);
+    if (!RefCounted::isShared()) {
+        for (Map* map : s_retired) {
+            delete map;
+        }
+        s_retired.clear();
+        if (published != NULL) {
+            m_map.swap(*published);
+            m_published.store(NULL, std::memory_order_relaxed);
+            delete published;
+        }
+        m_map[symbol] = value;
+        return value;
+    }
+
+    Map* copy = new Map(bindings());
+    (*copy)[symbol] = value;
+    m_published.store(copy, std::memory_order_release);
+    if (published != NULL) {
+        s_retired.push_back(published);
+    }
+    return value;
+}
+
 malEnvPtr malEnv::getRoot()
 {
     // Work our way down the the global environment.
-    for (malEnvPtr env = this; ; env = env->m_outer) {
+    for (malEnv* env = this; ; env = env->m_outer.ptr()) {
         if (!env->m_outer) {
             return env;
         }
@@ -3,10 +3,13 @@
 
 #include "MAL.h"
 
+#include <atomic>
 #include <map>
 
 class malEnv : public RefCounted {
 public:
+    typedef std::map<String, malValuePtr> Map;
+
     malEnv(malEnvPtr outer = NULL);
     malEnv(malEnvPtr outer,
            const StringVec& bindings,
@@ -16,13 +19,26 @@ public:
     ~malEnv();
 
     malValuePtr get(const String& symbol);
+    malValuePtr lookup(const String& symbol); // NULL if not found
     malEnvPtr   find(const String& symbol);
-    malValuePtr set(const String& symbol, malValuePtr value);
     malEnvPtr   getRoot();
 
+    // For environments which no other thread can see yet.
+    malValuePtr set(const String& symbol, malValuePtr value);
+
+    // For def! and defmacro!, which may change an environment that tasks
+    // on other threads are reading.
+    malValuePtr define(const String& symbol, malValuePtr value);
+
+    malEnvPtr   outer() const { return m_outer; }
+    const Map&  bindings() const {
+        const Map* published = m_published.load(std::memory_order_acquire);
+        return published != NULL ? *published : m_map;
+    }
+
 private:
-    typedef std::map<String, malValuePtr> Map;
     Map m_map;
+    std::atomic<Map*> m_published; // replaces m_map, see define
     malEnvPtr m_outer;
 };
 
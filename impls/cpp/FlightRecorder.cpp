@@ -0,0 +1,262 @@
+#include "FlightRecorder.h"
+#include "Environment.h"
+#include "Stats.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <mutex>
+#include <vector>
+
+#include <signal.h>
+#include <unistd.h>
+
+thread_local FlightRecorder::Ring* FlightRecorder::t_ring = NULL;
+
+static std::mutex   s_ringsMutex;
+static malEnv*      s_globals = NULL;
+
+// Rings are never freed, so that the events of threads which have finished
+// can still be dumped.
+std::vector<FlightRecorder::Ring*>& FlightRecorder::rings()
+{
+    static std::vector<Ring*>* rings = new std::vector<Ring*>;
+    return *rings;
+}
+
+FlightRecorder::Ring* FlightRecorder::newRing()
+{
+    Ring* r = new Ring;
+    for (auto& event : r->events) {
+        event.sequence = 0;
+    }
+    r->next = 0;
+    r->errorCount = 0;
+    for (auto& sequence : r->messageSequences) {
+        sequence = 0;
+    }
+
+    std::lock_guard<std::mutex> lock(s_ringsMutex);
+    rings().push_back(r);
+    r->thread = rings().size();
+    t_ring = r;
+    return r;
+}
+
+// Messages are copied, truncated if need be, as they are freed once caught.
+void FlightRecorder::noteError(const String& message)
+{
+    Ring* r = ring();
+    uint64_t index = r->errorCount++;
+    int slot = index % Ring::maxMessages;
+    std::atomic<char>* copy = r->messages[slot];
+    size_t length = std::min(message.size(), size_t(Ring::messageLength - 1));
+
+    r->messageSequences[slot].store(0, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    for (size_t i = 0; i < length; i++) {
+        copy[i].store(message[i], std::memory_order_relaxed);
+    }
+    copy[length].store('\0', std::memory_order_relaxed);
+    r->messageSequences[slot].store(index + 1, std::memory_order_release);
+    record(Error, NULL, index);
+}
+
+static const char* signalName(int signal)
+{
+    switch (signal) {
+        case SIGABRT:   return "SIGABRT";
+        case SIGBUS:    return "SIGBUS";
+        case SIGFPE:    return "SIGFPE";
+        case SIGILL:    return "SIGILL";
+        case SIGSEGV:   return "SIGSEGV";
+    }
+    return "a fatal signal";
+}
+
+static void dumpOnSignal(int signal)
+{
+    char reason[64];
+    snprintf(reason, sizeof(reason), "crashed with %s", signalName(signal));
+    FlightRecorder::dump(STDERR_FILENO, reason);
+    // The handler was reset, so this crashes as the signal would have.
+    raise(signal);
+}
+
+// The handler runs on a stack of its own, so that it can report running
+// out of stack on the main thread.
+void FlightRecorder::install(const malEnvPtr& globals)
+{
+    s_globals = globals.ptr();
+
+    static char alternateStack[64 << 10];
+    stack_t stack;
+    stack.ss_sp = alternateStack;
+    stack.ss_size = sizeof(alternateStack);
+    stack.ss_flags = 0;
+    sigaltstack(&stack, NULL);
+
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = &dumpOnSignal;
+    action.sa_flags = SA_RESETHAND | SA_ONSTACK;
+    sigemptyset(&action.sa_mask);
+    for (int signal : { SIGABRT, SIGBUS, SIGFPE, SIGILL, SIGSEGV }) {
+        sigaction(signal, &action, NULL);
+    }
+}
+
+// Pointers are only compared with the bound functions, never followed, as
+// the functions called may since have been freed.
+static const char* functionName(const void* lambda)
+{
+    if (s_globals != NULL) {
+        for (auto& it : s_globals->bindings()) {
+            if (it.second.ptr() == lambda) {
+                return it.first.c_str();
+            }
+        }
+    }
+    return "(fn*)";
+}
+
+// The name of a class, from its mangled name, without allocating. Names
+// which aren't simply a length and a name, such as those of templates, are
+// left as they are.
+static const char* className(const char* mangled)
+{
+    const char* name = mangled;
+    while ((*name >= '0') && (*name <= '9')) {
+        name++;
+    }
+    return (name != mangled) && (atoi(mangled) == (int)strlen(name))
+        ? name : mangled;
+}
+
+// Formats into a fixed buffer, rather than a String, so that nothing is
+// allocated while crashing.
+void FlightRecorder::dump(Emit emit, void* context, const char* reason,
+                          bool isCrashing)
+{
+    char line[256];
+    snprintf(line, sizeof(line), "Flight recorder: %s\n", reason);
+    emit(line, context);
+
+    std::unique_lock<std::mutex> lock(s_ringsMutex, std::defer_lock);
+    if (!isCrashing) {
+        lock.lock();
+    }
+    else if (!lock.try_lock()) {
+        emit("(the threads' events can't be read while another thread is "
+             "starting)\n", context);
+        return;
+    }
+    for (const Ring* r : rings()) {
+        uint64_t next = r->next.load(std::memory_order_acquire);
+        uint64_t first = next > capacity ? next - capacity : 0;
+        snprintf(line, sizeof(line), "Thread %d%s, %llu events recorded:\n",
+                 r->thread, r == t_ring ? " (current)" : "",
+                 (unsigned long long)next);
+        emit(line, context);
+
+        uint64_t overwritten = 0;
+        for (uint64_t i = first; i < next; i++) {
+            const Event& event = r->events[i % capacity];
+            uint64_t sequence = event.sequence.load(std::memory_order_acquire);
+            const void* subject =
+                event.subject.load(std::memory_order_relaxed);
+            uint64_t detail = event.detail.load(std::memory_order_relaxed);
+            Kind kind = event.kind.load(std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_acquire);
+            if ((sequence != i + 1) ||
+                (event.sequence.load(std::memory_order_relaxed) != sequence)) {
+                overwritten++;
+                continue;
+            }
+
+            switch (kind) {
+                case Call:
+                    snprintf(line, sizeof(line),
+                             "  call      %s, depth %llu\n",
+                             functionName(subject),
+                             (unsigned long long)detail);
+                    break;
+                case BuiltIn:
+                    snprintf(line, sizeof(line), "  builtin   %s\n",
+                             (int64_t)detail < 0
+                                ? "(unnamed)"
+                                : RuntimeStats::builtInName(detail));
+                    break;
+                case SpecialForm:
+                    snprintf(line, sizeof(line), "  special   %s\n",
+                             static_cast<const char*>(subject));
+                    break;
+                case Error: {
+                    char message[Ring::messageLength];
+                    snprintf(line, sizeof(line), "  error     %s\n",
+                             readMessage(r, detail, message)
+                                ? message : "(message overwritten)");
+                    break;
+                }
+                case Throw:
+                    snprintf(line, sizeof(line), "  throw     %s\n",
+                             className(static_cast<const char*>(subject)));
+                    break;
+                case Allocation:
+                    snprintf(line, sizeof(line),
+                             "  allocate  %s, %llu bytes\n",
+                             static_cast<const char*>(subject),
+                             (unsigned long long)detail);
+                    break;
+            }
+            emit(line, context);
+        }
+        if (overwritten > 0) {
+            snprintf(line, sizeof(line),
+                     "  (%llu event%s overwritten while being read)\n",
+                     (unsigned long long)overwritten, PLURAL(overwritten));
+            emit(line, context);
+        }
+    }
+}
+
+// Copies the message of the error numbered index into message, unless it
+// has been, or is being, overwritten.
+bool FlightRecorder::readMessage(const Ring* r, uint64_t index,
+                                 char* message)
+{
+    int slot = index % Ring::maxMessages;
+    const std::atomic<uint64_t>& sequence = r->messageSequences[slot];
+    if (sequence.load(std::memory_order_acquire) != index + 1) {
+        return false;
+    }
+    for (int i = 0; i < Ring::messageLength; i++) {
+        message[i] = r->messages[slot][i].load(std::memory_order_relaxed);
+        if (message[i] == '\0') {
+            break;
+        }
+    }
+    message[Ring::messageLength - 1] = '\0';
+    std::atomic_thread_fence(std::memory_order_acquire);
+    return sequence.load(std::memory_order_relaxed) == index + 1;
+}
+
+String FlightRecorder::dump(const char* reason)
+{
+    String text;
+    dump([](const char* line, void* context) {
+        *static_cast<String*>(context) += line;
+    }, &text, reason, false);
+    return text;
+}
+
+void FlightRecorder::dump(int fd, const char* reason)
+{
+    dump([](const char* line, void* context) {
+        int fd = *static_cast<int*>(context);
+        if (write(fd, line, strlen(line)) < 0) {
+            // There's nowhere left to report this.
+        }
+    }, &fd, reason, true);
+}
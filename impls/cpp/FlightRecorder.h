@@ -0,0 +1,119 @@
+#ifndef INCLUDE_FLIGHTRECORDER_H
+#define INCLUDE_FLIGHTRECORDER_H
+
+#include "String.h"
+
+#include <atomic>
+#include <cstdint>
+#include <typeinfo>
+#include <vector>
+
+class malEnv;
+class malLambda;
+template<class T> class RefCountedPtr;
+
+// Always records the most recent interpreter events of each thread in a
+// ring buffer of its own: calls, builtin calls, special forms, errors and
+// large allocations. Recording an event is a few stores, with no locks, so
+// that the recorder can be left on. It is dumped when a script fails with
+// an uncaught error, an assertion fails or the interpreter crashes, to show
+// what led up to it. Events are ordered within each thread only.
+class FlightRecorder {
+public:
+    enum { capacity = 256 };                // events kept per thread
+    enum { largeAllocation = 64 << 10 };    // bytes, to be recorded
+
+    static void noteCall(const malLambda* lambda, size_t depth) {
+        record(Call, lambda, depth);
+    }
+    static void noteBuiltIn(int index) { record(BuiltIn, NULL, index); }
+    static void noteSpecialForm(const char* name) {
+        record(SpecialForm, name, 0);
+    }
+    static void noteAllocation(const char* what, size_t bytes) {
+        if (bytes >= largeAllocation) {
+            record(Allocation, what, bytes);
+        }
+    }
+    static void noteError(const String& message);
+
+    // Only the type of a value thrown is recorded, as printing it could
+    // take a while, and it may be freed before the recorder is dumped.
+    static void noteThrow(const std::type_info& type) {
+        record(Throw, type.name(), 0);
+    }
+
+    // Names functions after their bindings in globals from then on, and
+    // dumps the recorder to stderr on fatal signals.
+    static void install(const RefCountedPtr<malEnv>& globals);
+
+    // Every thread's events, oldest first, under a heading giving reason.
+    static String dump(const char* reason);
+
+    // As above, but written straight to fd without allocating, so that it
+    // can be used while crashing. The events are left out if another
+    // thread holds the list of rings.
+    static void dump(int fd, const char* reason);
+
+private:
+    enum Kind { Call, BuiltIn, SpecialForm, Error, Throw, Allocation };
+
+    // Other threads may read a slot while it's being written, so each is
+    // a seqlock: sequence is the event's index + 1 once it's written, and
+    // 0 while it's being written, and a reader keeps the fields it read
+    // only if sequence was the same before and after.
+    struct Event {
+        std::atomic<uint64_t>       sequence;
+        std::atomic<const void*>    subject;    // the function, or a name
+        std::atomic<uint64_t>       detail;
+        std::atomic<Kind>           kind;
+    };
+
+    struct Ring;
+
+    static Ring* ring() { return t_ring != NULL ? t_ring : newRing(); }
+    static Ring* newRing();
+    static std::vector<Ring*>& rings();
+
+    static void record(Kind kind, const void* subject, uint64_t detail);
+    static bool readMessage(const Ring* r, uint64_t index, char* message);
+
+    // The String overload waits for the list of rings, but a crashing
+    // thread can't, as it may be the one holding it.
+    typedef void (*Emit)(const char* text, void* context);
+    static void dump(Emit emit, void* context, const char* reason,
+                     bool isCrashing);
+
+    static thread_local Ring* t_ring;
+};
+
+struct FlightRecorder::Ring {
+    enum { maxMessages = 8, messageLength = 120 };
+
+    Event                   events[capacity];
+    std::atomic<uint64_t>   next;
+    int                     thread;
+    uint64_t                errorCount;
+
+    // Messages are seqlocks too, numbered by error, and kept a character
+    // at a time, as they are copied while they may be being overwritten.
+    std::atomic<uint64_t>   messageSequences[maxMessages];
+    std::atomic<char>       messages[maxMessages][messageLength];
+};
+
+inline void FlightRecorder::record(Kind kind, const void* subject,
+                                   uint64_t detail)
+{
+    Ring* r = ring();
+    uint64_t next = r->next.load(std::memory_order_relaxed);
+    Event& event = r->events[next % capacity];
+    event.sequence.store(0, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    event.subject.store(subject, std::memory_order_relaxed);
+    event.detail.store(detail, std::memory_order_relaxed);
+    event.kind.store(kind, std::memory_order_relaxed);
+    event.sequence.store(next + 1, std::memory_order_release);
+    r->next.store(next + 1, std::memory_order_release);
+}
+
+#endif // INCLUDE_FLIGHTRECORDER_H
@@ -0,0 +1,212 @@
+#include "HeapDump.h"
+#include "Environment.h"
+#include "Profiler.h"
+
+#include <unordered_map>
+
+thread_local HeapRoots* HeapRoots::t_innermost = NULL;
+
+HeapRoots* HeapRoots::swap(HeapRoots* innermost)
+{
+    HeapRoots* previous = t_innermost;
+    t_innermost = innermost;
+    return previous;
+}
+
+// The bookkeeping of a node in a std::map, beyond its value.
+static const size_t mapNodeOverhead = 32;
+
+static size_t stringSize(const String& s)
+{
+    return s.capacity() >= sizeof(String) ? s.capacity() + 1 : 0;
+}
+
+static void addEdge(std::vector<const RefCounted*>& edges,
+                    const malValuePtr& value)
+{
+    if (value) {
+        edges.push_back(value.ptr());
+    }
+}
+
+static void addEdges(std::vector<const RefCounted*>& edges,
+                     const malValueVec& values)
+{
+    for (auto& value : values) {
+        addEdge(edges, value);
+    }
+}
+
+// Returns the size of object, and adds the objects it refers to to edges.
+size_t HeapDump::describe(const RefCounted* object,
+                          std::vector<const RefCounted*>& edges)
+{
+    if (const malEnv* env = dynamic_cast<const malEnv*>(object)) {
+        if (env->outer()) {
+            edges.push_back(env->outer().ptr());
+        }
+        size_t size = sizeof(malEnv);
+        for (auto& it : env->bindings()) {
+            addEdge(edges, it.second);
+            size += sizeof(it) + mapNodeOverhead + stringSize(it.first);
+        }
+        return size;
+    }
+
+    const malValue* v = static_cast<const malValue*>(object);
+    malValuePtr meta = v->meta();
+    if (meta != mal::nilValue()) {
+        addEdge(edges, meta);
+    }
+
+    if (const malStringBase* s = dynamic_cast<const malStringBase*>(v)) {
+        return sizeof(malString) + stringSize(s->value());
+    }
+    if (const malSequence* seq = dynamic_cast<const malSequence*>(v)) {
+        for (auto it = seq->begin(), end = seq->end(); it != end; ++it) {
+            addEdge(edges, *it);
+        }
+        return sizeof(malList) + sizeof(malValueVec) +
+               seq->count() * sizeof(malValuePtr);
+    }
+    if (const malHash* h = dynamic_cast<const malHash*>(v)) {
+        for (auto& it : h->map()) {
+            addEdge(edges, it.first);
+            addEdge(edges, it.second);
+        }
+        return sizeof(malHash) + h->map().size() *
+               (sizeof(malHash::Map::value_type) + mapNodeOverhead);
+    }
+    if (const malLambda* l = dynamic_cast<const malLambda*>(v)) {
+        addEdge(edges, l->getBody());
+        edges.push_back(l->getEnv().ptr());
+        return sizeof(malLambda) + l->getBindings().size() * sizeof(String);
+    }
+    if (const malMemoized* m = dynamic_cast<const malMemoized*>(v)) {
+        addEdge(edges, m->m_op);
+        std::lock_guard<std::mutex> lock(m->m_mutex);
+        for (auto& it : m->m_cache) {
+            addEdges(edges, it.first.args);
+            addEdge(edges, it.second.value);
+        }
+        return sizeof(malMemoized) + m->m_cache.size() *
+               (sizeof(malMemoized::Key) + sizeof(malMemoized::Entry) +
+                mapNodeOverhead);
+    }
+    if (const malAtom* a = dynamic_cast<const malAtom*>(v)) {
+        addEdge(edges, a->deref());
+        return sizeof(malAtom);
+    }
+    if (const malRef* r = dynamic_cast<const malRef*>(v)) {
+        std::lock_guard<std::recursive_mutex> lock(r->m_mutex);
+        for (auto& version : r->m_history) {
+            addEdge(edges, version.value);
+        }
+        return sizeof(malRef) +
+               r->m_history.size() * sizeof(malRef::Version);
+    }
+    if (const malChannel* c = dynamic_cast<const malChannel*>(v)) {
+        malValueVec contents = c->contents();
+        addEdges(edges, contents);
+        return sizeof(malChannel) + contents.size() * sizeof(malValuePtr);
+    }
+    if (const malPromise* p = dynamic_cast<const malPromise*>(v)) {
+        std::lock_guard<std::mutex> lock(p->m_state->mutex);
+        addEdge(edges, p->m_state->value);
+        return sizeof(malFuture);
+    }
+    if (const malTailCall* t = dynamic_cast<const malTailCall*>(v)) {
+        addEdges(edges, t->call());
+        addEdges(edges, t->then());
+        return sizeof(malTailCall) +
+               (t->call().size() + t->then().size()) * sizeof(malValuePtr);
+    }
+    if (const malTransducer* t = dynamic_cast<const malTransducer*>(v)) {
+        for (auto& stage : t->stages()) {
+            addEdge(edges, stage.op);
+        }
+        return sizeof(malTransducer) +
+               t->stages().size() * sizeof(malTransducer::Stage);
+    }
+    if (dynamic_cast<const malBuiltIn*>(v)) {
+        return sizeof(malBuiltIn);
+    }
+    return sizeof(malInteger); // also the size of a malConstant
+}
+
+struct HeapNode {
+    const RefCounted*   object;
+    int                 parent; // -1 for roots, -2 if not reachable
+};
+
+String HeapDump::write(malEnvPtr globals, size_t& objectCount)
+{
+    std::vector<HeapNode> nodes;
+    std::unordered_map<const RefCounted*, int> ids;
+    String rootLines;
+
+    auto reach = [&](const RefCounted* object, int parent) {
+        auto inserted = ids.insert(std::make_pair(object,
+                                                  (int)nodes.size()));
+        if (inserted.second) {
+            nodes.push_back(HeapNode { object, parent });
+        }
+        return inserted.first->second;
+    };
+    auto addRoot = [&](const RefCounted* object, const String& name) {
+        int id = reach(object, -1);
+        rootLines += STRF("root %d %s\n", id, name.c_str());
+    };
+
+    // Globals come first, so that paths lead to them where they can.
+    for (auto& it : globals->bindings()) {
+        addRoot(it.second.ptr(), it.first);
+    }
+    addRoot(globals.ptr(), "(globals)");
+    std::vector<const RefCounted*> stackRoots;
+    for (HeapRoots* r = HeapRoots::t_innermost; r != NULL; r = r->m_outer) {
+        r->addRoots(stackRoots);
+    }
+    for (auto root : stackRoots) {
+        addRoot(root, "(stack)");
+    }
+    for (auto function : CallStack::kept()) {
+        addRoot(function, "(profiler)");
+    }
+
+    std::vector<const RefCounted*> live = AllocationProfiler::liveObjects();
+    String objectLines;
+    std::vector<const RefCounted*> edges;
+    bool isReachable = true;
+    for (size_t i = 0; ; i++) {
+        if (i == nodes.size()) {
+            // Everything reachable has been written. Anything else which
+            // the allocation profiler knows to be alive is not.
+            if (!isReachable) {
+                break;
+            }
+            isReachable = false;
+            for (auto object : live) {
+                reach(object, -2);
+            }
+            if (i == nodes.size()) {
+                break;
+            }
+        }
+        const HeapNode node = nodes[i];
+        edges.clear();
+        size_t size = describe(node.object, edges);
+        objectLines += STRF("%zu %s %zu %d ", i,
+                            demangle(typeid(*node.object).name()).c_str(),
+                            size, node.object->refCount());
+        objectLines += node.parent == -1 ? "-" :
+                       node.parent == -2 ? "?" : STRF("%d", node.parent);
+        for (auto edge : edges) {
+            objectLines += STRF(" %d", reach(edge, isReachable ? i : -2));
+        }
+        objectLines += "\n";
+    }
+
+    objectCount = nodes.size();
+    return "mal-heap-dump 1\n" + rootLines + objectLines;
+}
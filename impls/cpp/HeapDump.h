@@ -0,0 +1,48 @@
+#ifndef INCLUDE_HEAPDUMP_H
+#define INCLUDE_HEAPDUMP_H
+
+#include "Types.h"
+
+// Values held on the native stack, such as by EVAL, which heap dumps start
+// from as well as the global environment. Each is linked in for its
+// lifetime, innermost first. go blocks have a chain each, and swap it in
+// whenever they run.
+class HeapRoots {
+public:
+    HeapRoots() : m_outer(t_innermost) { t_innermost = this; }
+    virtual ~HeapRoots() { t_innermost = m_outer; }
+
+    virtual void addRoots(std::vector<const RefCounted*>& roots) const = 0;
+
+    // Makes innermost the chain of this thread, returning the previous one.
+    static HeapRoots* swap(HeapRoots* innermost);
+
+private:
+    HeapRoots* m_outer;
+
+    static thread_local HeapRoots* t_innermost;
+
+    friend class HeapDump;
+};
+
+// Writes out the graph of objects reachable from the global environment,
+// the roots on this thread's stack and the functions the profilers keep
+// alive, for heapreport to analyse. Each object is written with its type,
+// an estimate of its size including the containers it owns, its reference
+// count, the object it was first reached from, which leads back to a root,
+// and the objects it refers to.
+//
+// While the allocation profiler is running, every object it has seen
+// allocated is known, so those which are still alive but can't be reached
+// are written too, as having no path to a root. They are kept alive by
+// reference cycles, or by native code.
+class HeapDump {
+public:
+    static String write(malEnvPtr globals, size_t& objectCount);
+
+private:
+    static size_t describe(const RefCounted* object,
+                           std::vector<const RefCounted*>& edges);
+};
+
+#endif // INCLUDE_HEAPDUMP_H
@@ -25,6 +25,7 @@ extern String rep(const String& input, malEnvPtr env);
 
 // Core.cpp
 extern void installCore(malEnvPtr env);
+extern malValuePtr findBuiltIn(const String& name); // NULL if unknown
 
 // Reader.cpp
 extern malValuePtr readStr(const String& input);
@@ -0,0 +1,553 @@
+#include "Profiler.h"
+#include "Environment.h"
+#include "Stats.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <tuple>
+#include <typeindex>
+#include <unordered_map>
+
+#include <signal.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+thread_local CallStack::Frames  CallStack::t_threadFrames;
+thread_local CallStack::Frames* CallStack::t_frames = NULL;
+std::atomic<int>                CallStack::s_profilerCount(0);
+std::atomic<bool>               RefCounted::s_isTracking(false);
+std::atomic<bool>               Tracer::s_isTracing(false);
+
+// A minute of samples at the default rate. Any more are dropped.
+static const size_t maxSamples = 60000;
+
+struct Sample {
+    size_t              depth;
+    const malLambda*    lambdas[CallStack::maxDepth];
+};
+
+// Allocated once, and never freed, as a late signal may still write to it.
+static Sample*              s_samples = NULL;
+static std::atomic<size_t>  s_sampleCount(0);
+static std::atomic<bool>    s_isSampling(false);
+
+typedef std::unordered_map<const malLambda*, malValuePtr> KeptMap;
+typedef std::unordered_map<const malLambda*, String> NameMap;
+
+// Each thread keeps the functions it calls alive in a map of its own, so
+// that calls don't contend for a lock. The maps are only looked at
+// together when a report is written, and a thread which exits hands its
+// map over to s_kept.
+struct KeptSet {
+    KeptSet();
+    ~KeptSet();
+
+    std::mutex  mutex;
+    KeptMap     kept;
+};
+
+static std::mutex               s_keptMutex; // guards the two below
+static KeptMap                  s_kept;
+static std::vector<KeptSet*>    s_keptSets;
+static thread_local KeptSet     t_keptSet;
+
+KeptSet::KeptSet()
+{
+    std::lock_guard<std::mutex> lock(s_keptMutex);
+    s_keptSets.push_back(this);
+}
+
+KeptSet::~KeptSet()
+{
+    std::lock_guard<std::mutex> lock(s_keptMutex);
+    s_keptSets.erase(std::find(s_keptSets.begin(), s_keptSets.end(), this));
+    s_kept.insert(kept.begin(), kept.end());
+}
+
+CallStack::Frames* CallStack::swap(Frames* frames)
+{
+    Frames* previous = t_frames;
+    t_frames = frames;
+    return previous;
+}
+
+void CallStack::noteProfiledCall(const malLambda* lambda)
+{
+    {
+        std::lock_guard<std::mutex> lock(t_keptSet.mutex);
+        malValuePtr& kept = t_keptSet.kept[lambda];
+        if (!kept) {
+            kept = const_cast<malLambda*>(lambda);
+        }
+    }
+    if (Tracer::isTracing()) {
+        Tracer::begin(lambda->isMacro() ? "macro" : "call", NULL, String(),
+                      lambda);
+    }
+}
+
+void CallStack::noteReturns(size_t count)
+{
+    if (Tracer::isTracing()) {
+        for (size_t i = 0; i < count; i++) {
+            Tracer::end();
+        }
+    }
+}
+
+void CallStack::addProfiler()
+{
+    s_profilerCount++;
+}
+
+// The functions kept alive are let go once the last profiler stops.
+void CallStack::removeProfiler()
+{
+    std::vector<KeptMap> kept(1);
+    std::lock_guard<std::mutex> lock(s_keptMutex);
+    if (--s_profilerCount == 0) {
+        kept[0].swap(s_kept);
+        for (KeptSet* set : s_keptSets) {
+            kept.push_back(KeptMap());
+            std::lock_guard<std::mutex> setLock(set->mutex);
+            kept.back().swap(set->kept);
+        }
+    }
+}
+
+std::vector<const malLambda*> CallStack::kept()
+{
+    std::vector<const malLambda*> kept;
+    std::lock_guard<std::mutex> lock(s_keptMutex);
+    for (auto& it : s_kept) {
+        kept.push_back(it.first);
+    }
+    for (KeptSet* set : s_keptSets) {
+        std::lock_guard<std::mutex> setLock(set->mutex);
+        for (auto& it : set->kept) {
+            kept.push_back(it.first);
+        }
+    }
+    std::sort(kept.begin(), kept.end());
+    kept.erase(std::unique(kept.begin(), kept.end()), kept.end());
+    return kept;
+}
+
+// Only functions which were kept alive, or are still bound, are looked at,
+// as the others may have been freed.
+static NameMap functionNames(malEnvPtr globals)
+{
+    NameMap names;
+    for (auto& it : globals->bindings()) {
+        if (const malLambda* lambda = DYNAMIC_CAST(malLambda, it.second)) {
+            String name = it.first;
+            std::replace(name.begin(), name.end(), ';', ':');
+            names[lambda] = name;
+        }
+    }
+    for (const malLambda* lambda : CallStack::kept()) {
+        if (names.find(lambda) == names.end()) {
+            String params;
+            for (auto& param : lambda->getBindings()) {
+                params += (params.empty() ? "" : " ") + param;
+            }
+            names[lambda] = "(fn* [" + params + "])";
+        }
+    }
+    return names;
+}
+
+static String functionName(const NameMap& names, const malLambda* lambda)
+{
+    auto it = names.find(lambda);
+    return it != names.end() ? it->second : String("(fn*)");
+}
+
+// Runs on whichever thread was using the CPU, in between any two of its
+// instructions, so this only copies the shadow stack.
+void Profiler::takeSample(int signal)
+{
+    size_t index = s_sampleCount.fetch_add(1, std::memory_order_relaxed);
+    if (index >= maxSamples) {
+        return;
+    }
+    const CallStack::Frames* frames = CallStack::frames();
+    Sample& sample = s_samples[index];
+    sample.depth = frames->depth;
+    size_t count = std::min<size_t>(sample.depth, CallStack::maxDepth);
+    for (size_t i = 0; i < count; i++) {
+        sample.lambdas[i] = frames->lambdas[i];
+    }
+}
+
+void Profiler::start(int samplesPerSecond)
+{
+    bool wasSampling = false;
+    MAL_CHECK(s_isSampling.compare_exchange_strong(wasSampling, true),
+              "The profiler is already running");
+    CallStack::addProfiler();
+
+    if (s_samples == NULL) {
+        s_samples = static_cast<Sample*>(calloc(maxSamples, sizeof(Sample)));
+
+        // The handler stays installed, as a SIGPROF which is still pending
+        // when the timer stops would otherwise end the process.
+        struct sigaction action;
+        memset(&action, 0, sizeof(action));
+        action.sa_handler = &Profiler::takeSample;
+        action.sa_flags = SA_RESTART;
+        sigemptyset(&action.sa_mask);
+        sigaction(SIGPROF, &action, NULL);
+    }
+    s_sampleCount = 0;
+
+    struct itimerval timer;
+    timer.it_interval.tv_sec = 0;
+    timer.it_interval.tv_usec = 1000000 / samplesPerSecond;
+    timer.it_value = timer.it_interval;
+    setitimer(ITIMER_PROF, &timer, NULL);
+}
+
+String Profiler::stop(malEnvPtr globals, int& sampleCount)
+{
+    MAL_CHECK(s_isSampling, "The profiler isn't running");
+
+    struct itimerval timer;
+    memset(&timer, 0, sizeof(timer));
+    setitimer(ITIMER_PROF, &timer, NULL);
+    sampleCount = std::min(s_sampleCount.load(), maxSamples);
+
+    NameMap names = functionNames(globals);
+    CallStack::removeProfiler();
+    s_isSampling = false;
+
+    std::map<String, int> stacks;
+    for (int i = 0; i < sampleCount; i++) {
+        const Sample& sample = s_samples[i];
+        size_t count = std::min<size_t>(sample.depth, CallStack::maxDepth);
+        String stack = (count == 0) ? "(top level)" : "";
+        for (size_t j = 0; j < count; j++) {
+            stack += (j == 0 ? "" : ";") +
+                     functionName(names, sample.lambdas[j]);
+        }
+        if (sample.depth > count) {
+            stack += ";...";
+        }
+        stacks[stack]++;
+    }
+
+    String folded;
+    for (auto& it : stacks) {
+        folded += STRF("%s %d\n", it.first.c_str(), it.second);
+    }
+    return folded;
+}
+
+// Allocations are attributed to the innermost function recorded on the
+// shadow stack, which is marked as such when calls go deeper than that.
+struct Site {
+    size_t  allocated;
+    size_t  allocatedBytes;
+    size_t  live;
+    size_t  liveBytes;
+};
+
+struct Allocation {
+    const malLambda*    function;
+    bool                isDeeper;
+    size_t              size;
+    Site*               site;   // set once the type is known
+};
+
+typedef std::tuple<const malLambda*, bool, std::type_index> SiteKey;
+
+static std::mutex                                   s_allocationMutex;
+static std::unordered_map<const void*, Allocation>  s_allocations;
+static std::map<SiteKey, Site>                      s_sites;
+
+void* RefCounted::trackedNew(size_t size)
+{
+    void* object = ::operator new(size);
+    Allocation allocation;
+    allocation.function = CallStack::innermost(allocation.isDeeper);
+    allocation.size = size;
+    allocation.site = NULL;
+
+    std::lock_guard<std::mutex> lock(s_allocationMutex);
+    s_allocations[object] = allocation;
+    return object;
+}
+
+void RefCounted::noteFirstUse(const RefCounted* object)
+{
+    const std::type_info& typeInfo = typeid(*object);
+    RuntimeStats::countAllocated(typeInfo, t_lastNew.object == object
+                                           ? t_lastNew.size : 0);
+    if (!isTracking()) {
+        return;
+    }
+    std::type_index type = typeInfo;
+
+    std::lock_guard<std::mutex> lock(s_allocationMutex);
+    auto it = s_allocations.find(object);
+    if ((it == s_allocations.end()) || (it->second.site != NULL)) {
+        return;
+    }
+    Allocation& allocation = it->second;
+    Site& site = s_sites[SiteKey(allocation.function, allocation.isDeeper,
+                                 type)];
+    site.allocated++;
+    site.allocatedBytes += allocation.size;
+    site.live++;
+    site.liveBytes += allocation.size;
+    allocation.site = &site;
+}
+
+void RefCounted::noteDelete(void* object)
+{
+    std::lock_guard<std::mutex> lock(s_allocationMutex);
+    auto it = s_allocations.find(object);
+    if (it == s_allocations.end()) {
+        return;
+    }
+    if (Site* site = it->second.site) {
+        site->live--;
+        site->liveBytes -= it->second.size;
+    }
+    s_allocations.erase(it);
+}
+
+static void forgetAllocations()
+{
+    std::lock_guard<std::mutex> lock(s_allocationMutex);
+    s_allocations.clear();
+    s_sites.clear();
+}
+
+void AllocationProfiler::start()
+{
+    bool wasTracking = false;
+    MAL_CHECK(RefCounted::s_isTracking.compare_exchange_strong(wasTracking,
+                                                                true),
+              "The allocation profiler is already running");
+    CallStack::addProfiler();
+}
+
+void AllocationProfiler::stop()
+{
+    MAL_CHECK(RefCounted::isTracking(),
+              "The allocation profiler isn't running");
+    RefCounted::s_isTracking = false;
+    forgetAllocations();
+    CallStack::removeProfiler();
+}
+
+String AllocationProfiler::report(malEnvPtr globals)
+{
+    MAL_CHECK(RefCounted::isTracking(),
+              "The allocation profiler isn't running");
+
+    NameMap names = functionNames(globals);
+    std::vector<std::pair<SiteKey, Site>> sites;
+    {
+        std::lock_guard<std::mutex> lock(s_allocationMutex);
+        sites.assign(s_sites.begin(), s_sites.end());
+    }
+    std::stable_sort(sites.begin(), sites.end(),
+        [](const std::pair<SiteKey, Site>& lhs,
+           const std::pair<SiteKey, Site>& rhs) {
+            return lhs.second.allocatedBytes > rhs.second.allocatedBytes;
+        });
+
+    String report = STRF("%10s %12s %10s %12s  %-16s %s\n", "allocated",
+                         "bytes", "live", "bytes", "type", "function");
+    for (auto& it : sites) {
+        const malLambda* function = std::get<0>(it.first);
+        String name = function == NULL ? String("(top level)")
+                                       : functionName(names, function);
+        if (std::get<1>(it.first)) {
+            name += ";...";
+        }
+        const Site& site = it.second;
+        report += STRF("%10zu %12zu %10zu %12zu  %-16s %s\n",
+                       site.allocated, site.allocatedBytes,
+                       site.live, site.liveBytes,
+                       demangle(std::get<2>(it.first).name()).c_str(),
+                       name.c_str());
+    }
+    return report;
+}
+
+// Objects are only counted once they're fully constructed.
+std::vector<const RefCounted*> AllocationProfiler::liveObjects()
+{
+    std::vector<const RefCounted*> objects;
+    std::lock_guard<std::mutex> lock(s_allocationMutex);
+    for (auto& it : s_allocations) {
+        if (it.second.site != NULL) {
+            objects.push_back(static_cast<const RefCounted*>(it.first));
+        }
+    }
+    return objects;
+}
+
+// The events of each thread are kept in a ring, so a long trace keeps its
+// end. Each ring has a lock, which is only ever contended while the trace
+// is being written out.
+struct TraceEvent {
+    int64_t             time;       // in nanoseconds since the trace started
+    const malLambda*    function;   // for calls, else name is set
+    const char*         category;
+    const char*         name;
+    String              detail;
+    int                 track;
+    char                phase;      // 'B'egin or 'E'nd
+};
+
+struct TraceBuffer {
+    enum { capacity = 1 << 16 };
+
+    TraceBuffer() : events(capacity), count(0) { }
+
+    std::mutex              mutex;
+    std::vector<TraceEvent> events;
+    size_t                  count;  // events recorded, including overwritten
+};
+
+static std::mutex                   s_traceBuffersMutex;
+static std::vector<TraceBuffer*>    s_traceBuffers;
+static thread_local TraceBuffer*    t_traceBuffer = NULL;
+static std::atomic<int>             s_nextTrack(1);
+static std::chrono::steady_clock::time_point s_traceStart;
+
+// Buffers are never freed, as the trace may outlive their threads.
+static TraceBuffer* traceBuffer()
+{
+    if (t_traceBuffer == NULL) {
+        t_traceBuffer = new TraceBuffer;
+        std::lock_guard<std::mutex> lock(s_traceBuffersMutex);
+        s_traceBuffers.push_back(t_traceBuffer);
+    }
+    return t_traceBuffer;
+}
+
+void Tracer::record(char phase, const char* category, const char* name,
+                    const String& detail, const malLambda* function)
+{
+    CallStack::Frames* frames = CallStack::frames();
+    if (frames->track == 0) {
+        frames->track = s_nextTrack++;
+    }
+    TraceBuffer* buffer = traceBuffer();
+    int64_t time = std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now() - s_traceStart).count();
+
+    std::lock_guard<std::mutex> lock(buffer->mutex);
+    TraceEvent& event = buffer->events[buffer->count++ % buffer->capacity];
+    event.time = time;
+    event.function = function;
+    event.category = category;
+    event.name = name;
+    event.detail = detail;
+    event.track = frames->track;
+    event.phase = phase;
+}
+
+void Tracer::begin(const char* category, const char* name,
+                   const String& detail, const malLambda* function)
+{
+    record('B', category, name, detail, function);
+}
+
+void Tracer::end()
+{
+    record('E', NULL, NULL, String(), NULL);
+}
+
+void Tracer::start()
+{
+    MAL_CHECK(!s_isTracing, "Tracing is already running");
+    {
+        std::lock_guard<std::mutex> lock(s_traceBuffersMutex);
+        for (auto buffer : s_traceBuffers) {
+            std::lock_guard<std::mutex> bufferLock(buffer->mutex);
+            buffer->count = 0;
+        }
+    }
+    s_traceStart = std::chrono::steady_clock::now();
+    CallStack::addProfiler();
+    s_isTracing = true;
+}
+
+static String traceEvent(const TraceEvent& event, const String& name,
+                         int64_t time)
+{
+    String json = STRF("{\"ph\":\"%c\",\"ts\":%lld.%03d,\"pid\":%d,"
+                       "\"tid\":%d", event.phase, (long long)(time / 1000),
+                       (int)(time % 1000), (int)getpid(), event.track);
+    if (event.phase == 'B') {
+        json += ",\"cat\":\"" + String(event.category) + "\",\"name\":" +
+                jsonEscape(name);
+        if (!event.detail.empty()) {
+            json += ",\"args\":{\"detail\":" + jsonEscape(event.detail) + "}";
+        }
+    }
+    return json + "}";
+}
+
+String Tracer::stop(malEnvPtr globals)
+{
+    MAL_CHECK(s_isTracing, "Tracing isn't running");
+    s_isTracing = false;
+    NameMap names = functionNames(globals);
+    CallStack::removeProfiler();
+
+    // Ends whose beginnings were overwritten, or came before the trace
+    // started, are dropped, and anything left open is ended at the last
+    // event of its thread.
+    String json = "{\"traceEvents\":[";
+    const char* separator = "\n";
+    std::lock_guard<std::mutex> lock(s_traceBuffersMutex);
+    for (auto buffer : s_traceBuffers) {
+        std::lock_guard<std::mutex> bufferLock(buffer->mutex);
+        size_t first = buffer->count > buffer->capacity
+                     ? buffer->count - buffer->capacity : 0;
+        std::map<int, std::pair<int, int64_t>> open; // track: (depth, time)
+        for (size_t i = first; i < buffer->count; i++) {
+            const TraceEvent& event = buffer->events[i % buffer->capacity];
+            std::pair<int, int64_t>& track = open[event.track];
+            if (event.phase == 'E') {
+                if (track.first == 0) {
+                    continue;
+                }
+                track.first--;
+            }
+            else {
+                track.first++;
+            }
+            track.second = event.time;
+            String name;
+            if (event.phase == 'B') {
+                name = event.function == NULL
+                     ? String(event.name)
+                     : functionName(names, event.function);
+            }
+            json += separator + traceEvent(event, name, event.time);
+            separator = ",\n";
+        }
+        for (auto& it : open) {
+            TraceEvent end;
+            end.track = it.first;
+            end.phase = 'E';
+            for (int i = 0; i < it.second.first; i++) {
+                json += separator + traceEvent(end, String(), it.second.second);
+                separator = ",\n";
+            }
+        }
+        buffer->count = 0;
+    }
+    return json + "\n],\"displayTimeUnit\":\"ms\"}\n";
+}
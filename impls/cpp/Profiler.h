@@ -0,0 +1,178 @@
+#ifndef INCLUDE_PROFILER_H
+#define INCLUDE_PROFILER_H
+
+#include "FlightRecorder.h"
+#include "Types.h"
+
+// A shadow stack of the mal functions running on each thread, kept so that
+// the sampling profiler can see which mal code is running from inside its
+// signal handler. A tail call replaces the caller's entry, just as it
+// replaces the caller's frame. While tracing, pushes and truncations are
+// also recorded as the starts and ends of calls.
+class CallStack {
+public:
+    enum { maxDepth = 64 }; // deeper calls are counted, but not recorded
+
+    struct Frames {
+        const malLambda*    lambdas[maxDepth];
+        size_t              depth;
+        int                 track;  // the trace's thread id, once needed
+    };
+
+    static size_t depth() { return frames()->depth; }
+
+    static void push(const malLambda* lambda) {
+        Frames* f = frames();
+        if (f->depth < maxDepth) {
+            f->lambdas[f->depth] = lambda;
+        }
+        noteCall(lambda);
+        FlightRecorder::noteCall(lambda, f->depth);
+        std::atomic_signal_fence(std::memory_order_release);
+        f->depth++;
+    }
+
+    static void truncate(size_t depth) {
+        Frames* f = frames();
+        if ((depth < f->depth) &&
+                (s_profilerCount.load(std::memory_order_relaxed) > 0)) {
+            noteReturns(f->depth - depth);
+        }
+        f->depth = depth;
+    }
+
+    // The innermost function recorded, or NULL at the top level. isDeeper
+    // is set if calls have gone deeper than that.
+    static const malLambda* innermost(bool& isDeeper) {
+        const Frames* f = frames();
+        size_t depth = f->depth < maxDepth ? f->depth : maxDepth;
+        isDeeper = f->depth > depth;
+        return depth == 0 ? NULL : f->lambdas[depth - 1];
+    }
+
+    // Makes frames the shadow stack of this thread, returning the previous
+    // one, which may be NULL. go blocks have a shadow stack each, and swap
+    // it in whenever they run.
+    static Frames* swap(Frames* frames);
+
+    // The functions being kept alive for the profilers.
+    static std::vector<const malLambda*> kept();
+
+    // Pushes a function for the lifetime of this object.
+    class Entry {
+    public:
+        Entry(const malLambda* lambda) : m_depth(depth()) { push(lambda); }
+        ~Entry() { truncate(m_depth); }
+
+    private:
+        size_t m_depth;
+    };
+
+private:
+    static Frames* frames() {
+        return t_frames != NULL ? t_frames : &t_threadFrames;
+    }
+
+    // While any profiler runs, this keeps every function it could report
+    // on alive until the report is written.
+    static void noteCall(const malLambda* lambda) {
+        if (s_profilerCount.load(std::memory_order_relaxed) > 0) {
+            noteProfiledCall(lambda);
+        }
+    }
+    static void noteProfiledCall(const malLambda* lambda);
+    static void noteReturns(size_t count);
+
+    static void addProfiler();
+    static void removeProfiler();
+
+    static thread_local Frames  t_threadFrames;
+    static thread_local Frames* t_frames;
+    static std::atomic<int>     s_profilerCount;
+
+    friend class AllocationProfiler;
+    friend class Profiler;
+    friend class Tracer;
+};
+
+// Samples the shadow stacks on a SIGPROF timer, which counts CPU time.
+class Profiler {
+public:
+    static void start(int samplesPerSecond);
+
+    // Returns the samples in the collapsed stack format read by flame graph
+    // tools: one line per distinct stack, outermost function first, with
+    // its count. Functions are named after their global bindings, if any.
+    static String stop(malEnvPtr globals, int& sampleCount);
+
+private:
+    static void takeSample(int signal);
+};
+
+// Counts the malValues and malEnvs allocated by each mal function, by their
+// type. Sizes are those of the objects themselves, not counting the vectors,
+// strings and maps they own.
+class AllocationProfiler {
+public:
+    static void start();
+    static void stop();
+
+    // One line per function and type, most bytes allocated first, giving
+    // the objects and bytes allocated since the profiler started, and how
+    // many of them are still live.
+    static String report(malEnvPtr globals);
+
+    // The objects seen allocated since the profiler started which are
+    // still alive. Empty if the profiler isn't running.
+    static std::vector<const RefCounted*> liveObjects();
+};
+
+// Records the starts and ends of calls, macro expansions, file reads and
+// reader invocations in a ring buffer per thread, keeping the most recent
+// events of each. Go blocks are traced as threads of their own.
+class Tracer {
+public:
+    static void start();
+
+    // Returns the events recorded in the Chrome trace event format, read by
+    // chrome://tracing and Perfetto. Calls still running are ended here.
+    static String stop(malEnvPtr globals);
+
+    static bool isTracing() {
+        return s_isTracing.load(std::memory_order_relaxed);
+    }
+
+    // Traces a span of work other than a call, for the lifetime of this
+    // object. The detail is shown as the span's argument.
+    class Scope {
+    public:
+        Scope(const char* category, const char* name,
+              const String& detail = String())
+        : m_isTraced(isTracing()) {
+            if (m_isTraced) {
+                begin(category, name, detail, NULL);
+            }
+        }
+        ~Scope() {
+            if (m_isTraced && isTracing()) {
+                end();
+            }
+        }
+
+    private:
+        bool m_isTraced;
+    };
+
+private:
+    static void begin(const char* category, const char* name,
+                      const String& detail, const malLambda* function);
+    static void end();
+    static void record(char phase, const char* category, const char* name,
+                       const String& detail, const malLambda* function);
+
+    static std::atomic<bool> s_isTracing;
+
+    friend class CallStack;
+};
+
+#endif // INCLUDE_PROFILER_H
@@ -1,4 +1,5 @@
 #include "MAL.h"
+#include "Profiler.h"
 #include "Types.h"
 
 #include <regex>
@@ -120,6 +121,7 @@ static malValuePtr processMacro(Tokeniser& tokeniser, const String& symbol);
 
 malValuePtr readStr(const String& input)
 {
+    Tracer::Scope scope("reader", "read");
     Tokeniser tokeniser(input);
     if (tokeniser.eof()) {
         throw malEmptyInputException();
@@ -3,6 +3,7 @@
 
 #include "Debug.h"
 
+#include <atomic>
 #include <cstddef>
 
 class RefCounted {
@@ -10,15 +11,93 @@ public:
     RefCounted() : m_refCount(0) { }
     virtual ~RefCounted() { }
 
-    const RefCounted* acquire() const { m_refCount++; return this; }
-    int release() const { return --m_refCount; }
-    int refCount() const { return m_refCount; }
+    const RefCounted* acquire() const {
+        int count;
+        if (__builtin_expect(isShared(), 0)) {
+            count = __atomic_fetch_add(&m_refCount, 1, __ATOMIC_RELAXED);
+        }
+        else {
+            count = m_refCount++;
+        }
+        if (count == 0) {
+            noteFirstUse(this);
+        }
+        return this;
+    }
+
+    int release() const {
+        if (__builtin_expect(isShared(), 0)) {
+            return __atomic_sub_fetch(&m_refCount, 1, __ATOMIC_ACQ_REL);
+        }
+        return --m_refCount;
+    }
+
+    int refCount() const {
+        return __atomic_load_n(&m_refCount, __ATOMIC_RELAXED);
+    }
+
+    // Reference counts are only updated with atomic instructions while
+    // objects may be shared with another thread, which is while any task
+    // is queued or running. Each task must be bracketed by these calls,
+    // and startSharing must be called before the task can be seen by any
+    // other thread.
+    static void startSharing() {
+        s_sharingCount.fetch_add(1, std::memory_order_acq_rel);
+    }
+    static void stopSharing() {
+        s_sharingCount.fetch_sub(1, std::memory_order_release);
+    }
+    static bool isShared() {
+        return s_sharingCount.load(std::memory_order_acquire) > 0;
+    }
+
+    // Objects are counted by type when they are first pointed to, by which
+    // time they are fully constructed, and again just before they are
+    // deleted. While allocations are being profiled, each object is also
+    // noted when it is allocated.
+    static void* operator new(size_t size) {
+        void* object = isTracking() ? trackedNew(size) : ::operator new(size);
+        t_lastNew.object = object;
+        t_lastNew.size = size;
+        return object;
+    }
+    static void operator delete(void* object) {
+        if (isTracking()) {
+            noteDelete(object);
+        }
+        ::operator delete(object);
+    }
+
+    static bool isTracking() {
+        return s_isTracking.load(std::memory_order_relaxed);
+    }
 
 private:
     RefCounted(const RefCounted&); // no copy ctor
     RefCounted& operator = (const RefCounted&); // no assignments
 
+    // A plain int, rather than a std::atomic, so that the compiler is free
+    // to optimize the unshared updates, which are most of them.
     mutable int m_refCount;
+
+    static std::atomic<int> s_sharingCount;
+
+    static void* trackedNew(size_t size);
+    static void noteFirstUse(const RefCounted* object);
+    static void noteLastUse(const RefCounted* object);
+    static void noteDelete(void* object);
+
+    static std::atomic<bool> s_isTracking;
+    friend class AllocationProfiler;
+
+    // The last allocation on this thread, from which each type's size is
+    // learnt when an object of that type is first used straight after.
+    struct LastNew {
+        const void* object;
+        size_t      size;
+    };
+    static thread_local LastNew t_lastNew;
+    template<class T> friend class RefCountedPtr;
 };
 
 template<class T>
@@ -32,11 +111,32 @@ public:
     RefCountedPtr(const RefCountedPtr& rhs) : m_object(0)
     { acquire(rhs.m_object); }
 
+    // Moving a pointer takes its reference over, rather than acquiring
+    // another, which saves the counting on temporaries and return values.
+    RefCountedPtr(RefCountedPtr&& rhs) noexcept : m_object(rhs.m_object)
+    { rhs.m_object = NULL; }
+
+    // Takes over a reference acquired by hand, as for an object kept in a
+    // std::atomic, so that releasing it goes through the usual path.
+    static RefCountedPtr adopt(T* object) {
+        RefCountedPtr ptr;
+        ptr.m_object = object;
+        return ptr;
+    }
+
     const RefCountedPtr& operator = (const RefCountedPtr& rhs) {
         acquire(rhs.m_object);
         return *this;
     }
 
+    const RefCountedPtr& operator = (RefCountedPtr&& rhs) {
+        T* object = rhs.m_object;
+        rhs.m_object = NULL;
+        release();
+        m_object = object;
+        return *this;
+    }
+
     bool operator == (const RefCountedPtr& rhs) const {
         return m_object == rhs.m_object;
     }
@@ -67,6 +167,7 @@ private:
 
     void release() {
         if ((m_object != NULL) && (m_object->release() == 0)) {
+            RefCounted::noteLastUse(m_object);
             delete m_object;
         }
     }
@@ -0,0 +1,233 @@
+#include "STM.h"
+
+#include <algorithm>
+#include <thread>
+
+// Refs keep at least one old value for each transaction which has needed
+// one, up to this many.
+static const size_t maxHistory = 16;
+static const int maxRetries = 10000;
+
+static std::atomic<int64_t> s_clock(0);
+static thread_local Transaction* t_current = NULL;
+
+class CurrentTransaction {
+public:
+    CurrentTransaction(Transaction* tx) : m_saved(t_current) {
+        t_current = tx;
+    }
+    ~CurrentTransaction() { t_current = m_saved; }
+
+private:
+    Transaction* m_saved;
+};
+
+Transaction::Suspend::Suspend()
+: m_saved(t_current)
+{
+    t_current = NULL;
+}
+
+Transaction::Suspend::~Suspend()
+{
+    t_current = m_saved;
+}
+
+malRef::malRef(malValuePtr value)
+: m_historyLimit(1)
+{
+    m_history.push_back(Version { value, 0 });
+}
+
+malRef::malRef(const malRef& that, malValuePtr meta)
+: malValue(meta)
+, m_historyLimit(1)
+{
+    m_history.push_back(Version { that.latest(), 0 });
+}
+
+malValuePtr malRef::deref() const
+{
+    if (Transaction* tx = Transaction::current()) {
+        return tx->read(const_cast<malRef*>(this));
+    }
+    return latest();
+}
+
+malValuePtr malRef::latest() const
+{
+    std::lock_guard<std::recursive_mutex> lock(m_mutex);
+    return m_history.back().value;
+}
+
+malValuePtr Transaction::run(malValuePtr op)
+{
+    malValueVec noArgs;
+    if (t_current != NULL) {
+        return APPLY(op, noArgs.begin(), noArgs.end());
+    }
+
+    for (int attempt = 0; attempt < maxRetries; attempt++) {
+        Transaction tx(s_clock.load(std::memory_order_acquire));
+        CurrentTransaction current(&tx);
+        try {
+            malValuePtr result = APPLY(op, noArgs.begin(), noArgs.end());
+            tx.commit();
+            return result;
+        }
+        catch (malTransactionRetry&) {
+            std::this_thread::yield();
+        }
+    }
+    MAL_FAIL("Transaction failed after %d retries", maxRetries);
+}
+
+Transaction* Transaction::current()
+{
+    return t_current;
+}
+
+malValuePtr Transaction::read(malRef* ref)
+{
+    auto it = m_entries.find(ref);
+    if ((it != m_entries.end()) && it->second.hasValue) {
+        return it->second.value;
+    }
+
+    std::lock_guard<std::recursive_mutex> lock(ref->m_mutex);
+    for (auto it = ref->m_history.rbegin(); it != ref->m_history.rend(); ++it) {
+        if (it->point <= m_readPoint) {
+            return it->value;
+        }
+    }
+
+    // The value we needed has already been discarded, so keep more of them
+    // from now on.
+    ref->m_historyLimit = std::min(ref->m_historyLimit + 1, maxHistory);
+    throw malTransactionRetry();
+}
+
+malValuePtr Transaction::set(malRef* ref, malValuePtr value)
+{
+    Entry& e = entry(ref);
+    MAL_CHECK(e.isSet || e.commutes.empty(), "Can't set a ref after commute");
+
+    // Give up early if this is bound to fail at commit.
+    checkUnchanged(ref);
+
+    e.value = value;
+    e.hasValue = e.isSet = true;
+    return value;
+}
+
+malValuePtr Transaction::commute(malRef* ref,
+                                 malValueIter opBegin, malValueIter opEnd)
+{
+    malValueVec call(opBegin, opEnd);
+    call.insert(call.begin() + 1, read(ref));
+    malValuePtr value = APPLY(call[0], call.begin() + 1, call.end());
+
+    Entry& e = entry(ref);
+    e.value = value;
+    e.hasValue = true;
+    if (!e.isSet) {
+        e.commutes.push_back(malValueVec(opBegin, opEnd));
+    }
+    return value;
+}
+
+malValuePtr Transaction::ensure(malRef* ref)
+{
+    entry(ref).isEnsured = true;
+    return read(ref);
+}
+
+Transaction::Entry& Transaction::entry(malRef* ref)
+{
+    Entry& e = m_entries[ref];
+    if (!e.ref) {
+        e.ref = ref;
+    }
+    return e;
+}
+
+void Transaction::checkUnchanged(malRef* ref)
+{
+    std::lock_guard<std::recursive_mutex> lock(ref->m_mutex);
+    if (ref->m_history.back().point > m_readPoint) {
+        throw malTransactionRetry();
+    }
+}
+
+// Commutes are applied again to the latest values, so that they never
+// conflict. This is done before the refs are locked, with the transaction
+// suspended, so that the functions can neither wait on a ref which is
+// locked out of order nor change the transaction while it commits.
+void Transaction::applyCommutes()
+{
+    Suspend suspend;
+    for (auto& it : m_entries) {
+        Entry& e = it.second;
+        if (e.isSet || e.commutes.empty()) {
+            continue;
+        }
+        malValuePtr value;
+        {
+            std::lock_guard<std::recursive_mutex> lock(it.first->m_mutex);
+            value = it.first->m_history.back().value;
+            e.commutedAt = it.first->m_history.back().point;
+        }
+        for (auto& op : e.commutes) {
+            malValueVec call(op);
+            call.insert(call.begin() + 1, value);
+            value = APPLY(call[0], call.begin() + 1, call.end());
+        }
+        e.value = value;
+    }
+}
+
+void Transaction::commit()
+{
+    while (1) {
+        applyCommutes();
+
+        // Refs are always locked in address order, so commits can't
+        // deadlock.
+        std::vector<std::unique_lock<std::recursive_mutex>> locks;
+        locks.reserve(m_entries.size());
+        for (auto& it : m_entries) {
+            locks.emplace_back(it.first->m_mutex);
+        }
+
+        bool isStale = false;
+        for (auto& it : m_entries) {
+            const Entry& e = it.second;
+            if (e.isSet || e.isEnsured) {
+                checkUnchanged(it.first);
+            }
+            else if (!e.commutes.empty()) {
+                isStale |= it.first->m_history.back().point != e.commutedAt;
+            }
+        }
+        if (isStale) {
+            // Another transaction wrote a commuted ref meanwhile.
+            continue;
+        }
+
+        // Transactions which start after this see all of the new values,
+        // as they can't read these refs until they are unlocked.
+        int64_t point = s_clock.fetch_add(1, std::memory_order_acq_rel) + 1;
+        for (auto& it : m_entries) {
+            Entry& e = it.second;
+            if (!e.isSet && e.commutes.empty()) {
+                continue;
+            }
+            malRef* ref = it.first;
+            ref->m_history.push_back(malRef::Version { e.value, point });
+            while (ref->m_history.size() > ref->m_historyLimit) {
+                ref->m_history.pop_front();
+            }
+        }
+        return;
+    }
+}
@@ -0,0 +1,68 @@
+#ifndef INCLUDE_STM_H
+#define INCLUDE_STM_H
+
+#include "Types.h"
+
+#include <map>
+
+// Thrown to abandon a transaction which conflicted with another, so that
+// dosync can run it again. It is not a mal exception, so try* ignores it.
+class malTransactionRetry { };
+
+// A dosync transaction. Reads see the refs as they were when it started.
+// Writes are buffered until commit, which locks the refs written, checks
+// that nobody else has written them since, and installs the new values.
+// commute is applied again at commit time to the latest value instead of
+// conflicting.
+class Transaction {
+public:
+    // Runs op in a transaction, retrying until it commits. Nested calls
+    // join the enclosing transaction.
+    static malValuePtr run(malValuePtr op);
+
+    // The transaction running on this thread, or NULL.
+    static Transaction* current();
+
+    // Hides the transaction running on this thread for as long as it
+    // lives, so that a pool task run by a thread waiting inside dosync
+    // doesn't join the transaction.
+    class Suspend {
+    public:
+        Suspend();
+        ~Suspend();
+
+    private:
+        Transaction* m_saved;
+    };
+
+    malValuePtr read(malRef* ref);
+    malValuePtr set(malRef* ref, malValuePtr value);
+    malValuePtr commute(malRef* ref, malValueIter opBegin, malValueIter opEnd);
+    malValuePtr ensure(malRef* ref);
+
+private:
+    struct Entry {
+        Entry() : hasValue(false), isSet(false), isEnsured(false)
+                , commutedAt(0) { }
+
+        malValuePtr                 ref; // keeps the ref alive
+        malValuePtr                 value;
+        bool                        hasValue;
+        bool                        isSet;
+        bool                        isEnsured;
+        std::vector<malValueVec>    commutes;
+        int64_t                     commutedAt; // point value came from
+    };
+
+    Transaction(int64_t readPoint) : m_readPoint(readPoint) { }
+
+    Entry& entry(malRef* ref);
+    void checkUnchanged(malRef* ref);
+    void applyCommutes();
+    void commit();
+
+    const int64_t           m_readPoint;
+    std::map<malRef*, Entry> m_entries; // also the order refs are locked in
+};
+
+#endif // INCLUDE_STM_H
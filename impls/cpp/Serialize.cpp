@@ -0,0 +1,875 @@
+#include "Serialize.h"
+#include "Environment.h"
+#include "Profiler.h"
+
+#include <cerrno>
+#include <climits>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <unordered_map>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Every record starts with a tag. Records for anything other than the
+// constants, integers, back-references and the global environment are
+// numbered in the order they start, and BACKREF refers to them by that
+// number. Closures' environments are written without their bindings, which
+// follow the top level value in blocks of their own, as that is where the
+// cycles between environments and the functions defined in them are broken.
+enum Tag {
+    TAG_END, TAG_BACKREF, TAG_NIL, TAG_TRUE, TAG_FALSE, TAG_INTEGER,
+    TAG_STRING, TAG_KEYWORD, TAG_SYMBOL, TAG_LIST, TAG_VECTOR, TAG_HASH,
+    TAG_BUILTIN, TAG_LAMBDA, TAG_MACRO, TAG_MEMOIZED, TAG_ATOM, TAG_REF,
+    TAG_TRANSDUCER, TAG_ENV, TAG_GLOBALS,
+};
+
+// Set on the tag of a record which is followed by its metadata.
+static const unsigned char hasMeta = 0x80;
+
+// The last byte is the format version.
+static const char magic[] = { 'm', 'a', 'l', 2 };
+
+// Records are written a part at a time, each part being some bytes, a value
+// or a reference to an environment. Whatever follows a value within its
+// record is kept on a stack with the rest of the work still to do, rather
+// than on the native stack, so there's no limit to how deep values can be.
+class Encoder {
+public:
+    Encoder() : m_out(magic, sizeof(magic)) { }
+
+    void value(malValuePtr value);
+    void bindings(malEnv* env);
+
+    // Writes the bindings of every environment which was referred to.
+    String finish();
+
+private:
+    struct Part {
+        Part() : env(NULL) { }
+
+        malValuePtr value;
+        malEnv*     env;
+        String      bytes; // if neither of the above
+    };
+
+    bool isBackRef(const void* object);
+    void write(const malValuePtr& value);
+    void env(malEnv* env);
+    void begin(Tag tag, const malValue* value);
+    void byte(unsigned char b);
+    void bytes(const char* data, size_t size);
+    void number(uint64_t n);
+    void signedNumber(int64_t n);
+    void string(const String& s);
+    void items(const malSequence* seq);
+    void queue(const malValuePtr& value);
+    void queue(malEnv* env);
+    void drain();
+
+    std::unordered_map<const void*, uint64_t> m_seen;
+    std::vector<malEnv*> m_pending;
+    malValueVec m_derefs; // so no seen address can be reused meanwhile
+    std::vector<Part> m_record; // the rest of the record being written
+    std::vector<Part> m_stack;  // the rest of those it is inside, last first
+    String m_out;
+};
+
+class Decoder {
+public:
+    Decoder(const char* data, size_t size, malEnvPtr globals);
+
+    malValuePtr value();
+
+    // Reads the bindings which follow the top level value.
+    void finish();
+
+private:
+    struct Slot {
+        malValuePtr value;
+        malEnvPtr   env;
+    };
+
+    // A record which is still being read, as it contains values which are
+    // yet to be read.
+    struct Record {
+        Record(unsigned char tag, size_t slot)
+        : tag(tag & ~hasMeta), needsMeta((tag & hasMeta) != 0)
+        , isStarted(false), slot(slot), count(0), number(0) { }
+
+        unsigned char           tag;
+        bool                    needsMeta;
+        bool                    isStarted;
+        size_t                  slot;
+        malValuePtr             meta;
+        uint64_t                count;  // of values to read
+        uint64_t                number; // a memo limit, or if evaluated
+        malValueVec             items;
+        StringVec               bindings;
+        malTransducer::Stages   stages;
+        malValuePtr             atom;   // made before its value is read
+    };
+
+    unsigned char byte();
+    uint64_t number();
+    int64_t signedNumber();
+    String string();
+    uint64_t count();
+    malEnvPtr env(unsigned char tag);
+    const Slot& backRef();
+    size_t reserve();
+    malValuePtr start(std::vector<Record>& records);
+    malValuePtr resume(Record& record, const malValuePtr& value);
+
+    const char*         m_pos;
+    const char* const   m_end;
+    malEnvPtr           m_globals;
+    std::vector<Slot>   m_slots;
+};
+
+#define CHECK_DATA(condition) \
+    MAL_CHECK(condition, "Corrupt serialized data")
+
+bool Encoder::isBackRef(const void* object)
+{
+    auto it = m_seen.find(object);
+    if (it != m_seen.end()) {
+        byte(TAG_BACKREF);
+        number(it->second);
+        return true;
+    }
+    uint64_t index = m_seen.size();
+    m_seen[object] = index;
+    return false;
+}
+
+void Encoder::begin(Tag tag, const malValue* value)
+{
+    malValuePtr meta = value->meta();
+    if (meta == mal::nilValue()) {
+        byte(tag);
+    }
+    else {
+        byte(tag | hasMeta);
+        queue(meta);
+    }
+}
+
+void Encoder::byte(unsigned char b)
+{
+    const char c = static_cast<char>(b);
+    bytes(&c, 1);
+}
+
+// Bytes go straight out until the record has queued something, and are
+// queued to follow it after that.
+void Encoder::bytes(const char* data, size_t size)
+{
+    if (m_record.empty()) {
+        m_out.append(data, size);
+        return;
+    }
+    if (m_record.back().value || m_record.back().env) {
+        m_record.push_back(Part());
+    }
+    m_record.back().bytes.append(data, size);
+}
+
+void Encoder::number(uint64_t n)
+{
+    while (n >= 0x80) {
+        byte(static_cast<unsigned char>(n | 0x80));
+        n >>= 7;
+    }
+    byte(static_cast<unsigned char>(n));
+}
+
+void Encoder::signedNumber(int64_t n)
+{
+    // Zig-zag, so that small negative numbers stay short.
+    number((static_cast<uint64_t>(n) << 1) ^ static_cast<uint64_t>(n >> 63));
+}
+
+void Encoder::string(const String& s)
+{
+    number(s.size());
+    bytes(s.data(), s.size());
+}
+
+void Encoder::items(const malSequence* seq)
+{
+    number(seq->count());
+    for (auto it = seq->begin(), end = seq->end(); it != end; ++it) {
+        queue(*it);
+    }
+}
+
+void Encoder::queue(const malValuePtr& value)
+{
+    m_record.push_back(Part());
+    m_record.back().value = value;
+}
+
+void Encoder::queue(malEnv* env)
+{
+    if (m_record.empty()) {
+        this->env(env);
+        return;
+    }
+    m_record.push_back(Part());
+    m_record.back().env = env;
+}
+
+// Writes what has been queued, and everything in the values queued.
+void Encoder::drain()
+{
+    while (1) {
+        m_stack.insert(m_stack.end(),
+                       std::make_move_iterator(m_record.rbegin()),
+                       std::make_move_iterator(m_record.rend()));
+        m_record.clear();
+        if (m_stack.empty()) {
+            return;
+        }
+        Part part = std::move(m_stack.back());
+        m_stack.pop_back();
+        if (part.value) {
+            write(part.value);
+        }
+        else if (part.env) {
+            env(part.env);
+        }
+        else {
+            m_out.append(part.bytes);
+        }
+    }
+}
+
+void Encoder::value(malValuePtr value)
+{
+    queue(value);
+    drain();
+}
+
+// Writes the start of a value's record, and queues the rest.
+void Encoder::write(const malValuePtr& value)
+{
+    const malValue* v = value.ptr();
+    if (value == mal::nilValue()) {
+        byte(TAG_NIL);
+        return;
+    }
+    if (value == mal::trueValue()) {
+        byte(TAG_TRUE);
+        return;
+    }
+    if (value == mal::falseValue()) {
+        byte(TAG_FALSE);
+        return;
+    }
+    if (const malInteger* i = dynamic_cast<const malInteger*>(v)) {
+        // Not worth referring back to.
+        begin(TAG_INTEGER, v);
+        signedNumber(i->value());
+        return;
+    }
+    if (isBackRef(v)) {
+        return;
+    }
+
+    if (const malString* s = dynamic_cast<const malString*>(v)) {
+        begin(TAG_STRING, v);
+        string(s->value());
+    }
+    else if (const malKeyword* k = dynamic_cast<const malKeyword*>(v)) {
+        begin(TAG_KEYWORD, v);
+        string(k->value());
+    }
+    else if (const malSymbol* s = dynamic_cast<const malSymbol*>(v)) {
+        begin(TAG_SYMBOL, v);
+        string(s->value());
+    }
+    else if (const malList* l = dynamic_cast<const malList*>(v)) {
+        begin(TAG_LIST, v);
+        items(l);
+    }
+    else if (const malVector* l = dynamic_cast<const malVector*>(v)) {
+        begin(TAG_VECTOR, v);
+        items(l);
+    }
+    else if (const malHash* h = dynamic_cast<const malHash*>(v)) {
+        begin(TAG_HASH, v);
+        byte(h->isEvaluated());
+        number(h->map().size());
+        for (auto& it : h->map()) {
+            queue(it.first);
+            queue(it.second);
+        }
+    }
+    else if (const malBuiltIn* b = dynamic_cast<const malBuiltIn*>(v)) {
+        begin(TAG_BUILTIN, v);
+        string(b->name());
+    }
+    else if (const malLambda* l = dynamic_cast<const malLambda*>(v)) {
+        begin(l->isMacro() ? TAG_MACRO : TAG_LAMBDA, v);
+        number(l->getBindings().size());
+        for (auto& binding : l->getBindings()) {
+            string(binding);
+        }
+        queue(l->getBody());
+        queue(l->getEnv().ptr());
+    }
+    else if (const malMemoized* m = dynamic_cast<const malMemoized*>(v)) {
+        begin(TAG_MEMOIZED, v);
+        number(m->limit());
+        queue(m->op());
+    }
+    else if (const malAtom* a = dynamic_cast<const malAtom*>(v)) {
+        begin(TAG_ATOM, v);
+        m_derefs.push_back(a->deref());
+        queue(m_derefs.back());
+    }
+    else if (const malRef* r = dynamic_cast<const malRef*>(v)) {
+        begin(TAG_REF, v);
+        m_derefs.push_back(r->deref());
+        queue(m_derefs.back());
+    }
+    else if (const malTransducer* t = dynamic_cast<const malTransducer*>(v)) {
+        begin(TAG_TRANSDUCER, v);
+        number(t->stages().size());
+        for (auto& stage : t->stages()) {
+            byte(stage.kind);
+            if (stage.op) {
+                queue(stage.op);
+            }
+            else {
+                signedNumber(stage.count);
+            }
+        }
+    }
+    else {
+        MAL_FAIL("%s can't be serialized", v->print(true).c_str());
+    }
+}
+
+void Encoder::env(malEnv* env)
+{
+    if (!env->outer()) {
+        byte(TAG_GLOBALS);
+        return;
+    }
+    if (isBackRef(env)) {
+        return;
+    }
+    byte(TAG_ENV);
+    this->env(env->outer().ptr());
+    m_pending.push_back(env);
+}
+
+void Encoder::bindings(malEnv* env)
+{
+    this->env(env);
+    number(env->bindings().size());
+    for (auto& it : env->bindings()) {
+        string(it.first);
+        queue(it.second);
+    }
+    drain();
+}
+
+String Encoder::finish()
+{
+    // Writing these bindings may find more environments.
+    for (size_t i = 0; i < m_pending.size(); i++) {
+        bindings(m_pending[i]);
+    }
+    m_out.push_back(TAG_END);
+    return m_out;
+}
+
+Decoder::Decoder(const char* data, size_t size, malEnvPtr globals)
+: m_pos(data)
+, m_end(data + size)
+, m_globals(globals)
+{
+    CHECK_DATA((size >= sizeof(magic)) &&
+               (memcmp(data, magic, sizeof(magic) - 1) == 0));
+    MAL_CHECK(data[sizeof(magic) - 1] == magic[sizeof(magic) - 1],
+              "Serialized data is from an incompatible version");
+    m_pos += sizeof(magic);
+}
+
+unsigned char Decoder::byte()
+{
+    CHECK_DATA(m_pos < m_end);
+    return *m_pos++;
+}
+
+uint64_t Decoder::number()
+{
+    uint64_t n = 0;
+    for (int shift = 0; shift < 64; shift += 7) {
+        unsigned char b = byte();
+        n |= static_cast<uint64_t>(b & 0x7f) << shift;
+        if ((b & 0x80) == 0) {
+            return n;
+        }
+    }
+    MAL_FAIL("Corrupt serialized data");
+}
+
+int64_t Decoder::signedNumber()
+{
+    uint64_t n = number();
+    return static_cast<int64_t>((n >> 1) ^ (0 - (n & 1)));
+}
+
+String Decoder::string()
+{
+    uint64_t size = number();
+    CHECK_DATA(size <= static_cast<uint64_t>(m_end - m_pos));
+    String s(m_pos, size);
+    m_pos += size;
+    return s;
+}
+
+// A count of things to follow, each of which takes at least a byte.
+uint64_t Decoder::count()
+{
+    uint64_t count = number();
+    CHECK_DATA(count <= static_cast<uint64_t>(m_end - m_pos));
+    return count;
+}
+
+const Decoder::Slot& Decoder::backRef()
+{
+    uint64_t index = number();
+    CHECK_DATA(index < m_slots.size());
+    return m_slots[index];
+}
+
+size_t Decoder::reserve()
+{
+    m_slots.push_back(Slot());
+    return m_slots.size() - 1;
+}
+
+// Records still being read are kept here rather than on the native stack,
+// so there's no limit to how deep values can be. Each value read is handed
+// to the record it is in, until one needs another value.
+malValuePtr Decoder::value()
+{
+    std::vector<Record> records;
+    while (1) {
+        malValuePtr value = start(records);
+        while (value) {
+            if (records.empty()) {
+                return value;
+            }
+            value = resume(records.back(), value);
+            if (value) {
+                records.pop_back();
+            }
+        }
+    }
+}
+
+// Reads a tag, and returns the value if that is all of it, or else starts
+// its record and returns the value if the record is complete, or NULL.
+malValuePtr Decoder::start(std::vector<Record>& records)
+{
+    unsigned char tag = byte();
+    switch (tag) {
+        case TAG_NIL:       return mal::nilValue();
+        case TAG_TRUE:      return mal::trueValue();
+        case TAG_FALSE:     return mal::falseValue();
+        case TAG_INTEGER:   return mal::integer(signedNumber());
+        case TAG_BACKREF: {
+            // Only a value which contains itself other than through an atom
+            // or an environment can refer back to one still being read.
+            malValuePtr value = backRef().value;
+            CHECK_DATA(value);
+            return value;
+        }
+    }
+
+    // Integers aren't referred back to.
+    static const size_t noSlot = SIZE_MAX;
+    records.push_back(Record(tag, ((tag & ~hasMeta) == TAG_INTEGER)
+                                  ? noSlot : reserve()));
+    malValuePtr value = resume(records.back(), NULL);
+    if (value) {
+        records.pop_back();
+    }
+    return value;
+}
+
+// Reads the rest of a record, given the value just read from inside it, or
+// NULL to begin with. Returns the value the record makes once it is
+// complete, or NULL if it needs another value.
+malValuePtr Decoder::resume(Record& record, const malValuePtr& value)
+{
+    if (record.needsMeta) {
+        if (!value) {
+            return NULL;
+        }
+        record.meta = value;
+        record.needsMeta = false;
+    }
+    const bool isStarting = !record.isStarted;
+    record.isStarted = true;
+
+    malValuePtr result;
+    switch (record.tag) {
+        case TAG_INTEGER:
+            result = mal::integer(signedNumber());
+            break;
+
+        case TAG_STRING:
+            result = mal::string(string());
+            break;
+
+        case TAG_KEYWORD:
+            result = mal::keyword(string());
+            break;
+
+        case TAG_SYMBOL:
+            result = mal::symbol(string());
+            break;
+
+        case TAG_LIST:
+        case TAG_VECTOR:
+        case TAG_HASH:
+            if (isStarting) {
+                if (record.tag == TAG_HASH) {
+                    record.number = byte() != 0;
+                    record.count = count() * 2;
+                }
+                else {
+                    record.count = count();
+                }
+                record.items.reserve(record.count);
+            }
+            else {
+                record.items.push_back(value);
+            }
+            if (record.items.size() < record.count) {
+                return NULL;
+            }
+            if (record.tag == TAG_HASH) {
+                result = mal::hash(record.items.begin(), record.items.end(),
+                                   record.number != 0);
+            }
+            else {
+                malValueVec* items = new malValueVec;
+                items->swap(record.items);
+                result = (record.tag == TAG_LIST) ? mal::list(items)
+                                                  : mal::vector(items);
+            }
+            break;
+
+        case TAG_BUILTIN: {
+            String name = string();
+            result = findBuiltIn(name);
+            MAL_CHECK(result, "Unknown builtin %s", name.c_str());
+            break;
+        }
+
+        case TAG_LAMBDA:
+        case TAG_MACRO:
+            if (isStarting) {
+                uint64_t count = this->count();
+                for (uint64_t i = 0; i < count; i++) {
+                    record.bindings.push_back(string());
+                }
+                return NULL; // for the body
+            }
+            result = mal::lambda(record.bindings, value, env(byte()));
+            if (record.tag == TAG_MACRO) {
+                result = mal::macro(*STATIC_CAST(malLambda, result));
+            }
+            break;
+
+        case TAG_MEMOIZED:
+            if (isStarting) {
+                record.number = number();
+                return NULL;
+            }
+            result = mal::memoize(value, record.number);
+            break;
+
+        case TAG_ATOM:
+            // Made first, so the value may contain the atom.
+            if (isStarting) {
+                record.atom = mal::atom(mal::nilValue());
+                if (record.meta) {
+                    record.atom = record.atom->withMeta(record.meta);
+                }
+                m_slots[record.slot].value = record.atom;
+                return NULL;
+            }
+            STATIC_CAST(malAtom, record.atom)->reset(value);
+            return record.atom;
+
+        case TAG_REF:
+            if (isStarting) {
+                return NULL;
+            }
+            result = mal::ref(value);
+            break;
+
+        case TAG_TRANSDUCER:
+            if (isStarting) {
+                record.count = count();
+            }
+            else {
+                record.stages.back().op = value;
+            }
+            while (record.stages.size() < record.count) {
+                malTransducer::Stage stage = { malTransducer::MAP, NULL, 0 };
+                unsigned char kind = byte();
+                CHECK_DATA(kind <= malTransducer::PARTITION);
+                stage.kind = static_cast<malTransducer::Kind>(kind);
+                record.stages.push_back(stage);
+                if ((kind == malTransducer::MAP) ||
+                    (kind == malTransducer::FILTER)) {
+                    return NULL; // for the op
+                }
+                record.stages.back().count = signedNumber();
+            }
+            result = mal::transducer(record.stages);
+            break;
+
+        default:
+            MAL_FAIL("Corrupt serialized data");
+    }
+
+    if (record.meta) {
+        result = result->withMeta(record.meta);
+    }
+    if (record.tag != TAG_INTEGER) {
+        m_slots[record.slot].value = result;
+    }
+    return result;
+}
+
+malEnvPtr Decoder::env(unsigned char tag)
+{
+    switch (tag) {
+        case TAG_GLOBALS:
+            return m_globals;
+
+        case TAG_BACKREF: {
+            malEnvPtr env = backRef().env;
+            CHECK_DATA(env);
+            return env;
+        }
+
+        case TAG_ENV: {
+            size_t slot = reserve();
+            malEnvPtr outer = env(byte());
+            m_slots[slot].env = new malEnv(outer);
+            return m_slots[slot].env;
+        }
+    }
+    MAL_FAIL("Corrupt serialized data");
+}
+
+void Decoder::finish()
+{
+    for (unsigned char tag; (tag = byte()) != TAG_END; ) {
+        malEnvPtr env = this->env(tag);
+        uint64_t count = number();
+        for (uint64_t i = 0; i < count; i++) {
+            String name = string();
+            env->set(name, value());
+        }
+    }
+    CHECK_DATA(m_pos == m_end);
+}
+
+String serialize(malValuePtr value)
+{
+    Encoder encoder;
+    encoder.value(value);
+    return encoder.finish();
+}
+
+malValuePtr deserialize(const char* data, size_t size, malEnvPtr globals)
+{
+    Decoder decoder(data, size, globals);
+    malValuePtr value = decoder.value();
+    decoder.finish();
+    return value;
+}
+
+static void writeFile(const String& path, const String& data)
+{
+    // Written alongside and renamed into place, so that nobody reading the
+    // file ever sees half of it.
+    String tempPath = STRF("%s.%d.tmp", path.c_str(), getpid());
+    {
+        std::ofstream file(tempPath.c_str(), std::ios::out | std::ios::binary);
+        MAL_CHECK(!file.fail(), "Cannot open %s", tempPath.c_str());
+        file.write(data.data(), data.size());
+        MAL_CHECK(!file.fail(), "Cannot write %s", tempPath.c_str());
+    }
+    MAL_CHECK(rename(tempPath.c_str(), path.c_str()) == 0,
+              "Cannot write %s: %s", path.c_str(), strerror(errno));
+}
+
+class MappedFile {
+public:
+    MappedFile(const String& path) : m_data(MAP_FAILED), m_size(0) {
+        int fd = open(path.c_str(), O_RDONLY);
+        MAL_CHECK(fd >= 0, "Cannot open %s", path.c_str());
+        struct stat info;
+        if (fstat(fd, &info) == 0) {
+            m_size = info.st_size;
+            m_data = mmap(NULL, m_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        }
+        close(fd);
+        MAL_CHECK(m_data != MAP_FAILED, "Cannot read %s", path.c_str());
+    }
+
+    ~MappedFile() { munmap(m_data, m_size); }
+
+    const char* data() const { return static_cast<const char*>(m_data); }
+    size_t size() const { return m_size; }
+
+private:
+    void*  m_data;
+    size_t m_size;
+};
+
+void serializeFile(const String& path, malValuePtr value)
+{
+    writeFile(path, serialize(value));
+}
+
+malValuePtr deserializeFile(const String& path, malEnvPtr globals)
+{
+    MappedFile file(path);
+    return deserialize(file.data(), file.size(), globals);
+}
+
+void saveImage(const String& path, malEnvPtr env)
+{
+    Encoder encoder;
+    encoder.value(mal::nilValue());
+    encoder.bindings(env.ptr());
+    writeFile(path, encoder.finish());
+}
+
+void loadImage(const String& path, malEnvPtr env)
+{
+    deserializeFile(path, env);
+}
+
+// Parsed files are cached in here, each under a hash of its path only, so
+// that parsing a file again replaces its stale entry. MAL_CACHE_DIR
+// overrides the default of ~/.cache/mal, and setting it empty turns the
+// cache off.
+static const String& cacheDir()
+{
+    static const String dir = [] {
+        if (const char* dir = getenv("MAL_CACHE_DIR")) {
+            return String(dir);
+        }
+        const char* home = getenv("HOME");
+        if (home == NULL) {
+            return String();
+        }
+        String dir = String(home) + "/.cache";
+        mkdir(dir.c_str(), 0755);
+        return dir + "/mal";
+    }();
+    return dir;
+}
+
+// Bump this whenever the reader changes what it makes of some text, so
+// that files parsed by an older reader are parsed again.
+static const int readerVersion = 1;
+
+// An entry is only used if it was made from the same path, size and
+// modification time, by the same reader and serialization format.
+static String cacheKey(const String& path, String& realPath)
+{
+    char resolved[PATH_MAX];
+    struct stat info;
+    if ((realpath(path.c_str(), resolved) == NULL) ||
+            (stat(resolved, &info) != 0)) {
+        return String();
+    }
+    realPath = resolved;
+#ifdef __APPLE__
+    long nanoseconds = info.st_mtimespec.tv_nsec;
+#else
+    long nanoseconds = info.st_mtim.tv_nsec;
+#endif
+    return STRF("%s\n%lld.%09ld\n%lld\nreader %d, format %d", resolved,
+                static_cast<long long>(info.st_mtime), nanoseconds,
+                static_cast<long long>(info.st_size), readerVersion,
+                magic[sizeof(magic) - 1]);
+}
+
+static String cachePath(const String& realPath)
+{
+    uint64_t hash = 14695981039346656037ULL; // FNV-1a
+    for (unsigned char c : realPath) {
+        hash = (hash ^ c) * 1099511628211ULL;
+    }
+    return STRF("%s/%016llx.malc", cacheDir().c_str(),
+                static_cast<unsigned long long>(hash));
+}
+
+malValuePtr readFile(const String& path)
+{
+    Tracer::Scope scope("io", "read-file", path);
+    String realPath;
+    String key = cacheDir().empty() ? String() : cacheKey(path, realPath);
+    // A missing entry, or one from another version, is expected, so it is
+    // looked for without failing, which would be recorded as an error.
+    // Anything else wrong with it just means reading the file.
+    String cached = key.empty() ? String() : cachePath(realPath);
+    if (!key.empty() && (access(cached.c_str(), R_OK) == 0)) {
+        try {
+            MappedFile file(cached);
+            if ((file.size() >= sizeof(magic)) &&
+                    (memcmp(file.data(), magic, sizeof(magic)) == 0)) {
+                malValuePtr value =
+                    deserialize(file.data(), file.size(), NULL);
+                const malVector* entry = VALUE_CAST(malVector, value);
+                const malString* entryKey = entry->count() == 2
+                    ? DYNAMIC_CAST(malString, entry->item(0)) : NULL;
+                if ((entryKey != NULL) && (entryKey->value() == key)) {
+                    return entry->item(1);
+                }
+            }
+        }
+        catch (String&) { }
+    }
+
+    std::ifstream file(path.c_str(), std::ios::in | std::ios::binary);
+    MAL_CHECK(!file.fail(), "Cannot open %s", path.c_str());
+    String source((std::istreambuf_iterator<char>(file.rdbuf())),
+                  std::istreambuf_iterator<char>());
+    malValuePtr forms = readStr("(do " + source + "\nnil)");
+
+    if (!key.empty()) {
+        mkdir(cacheDir().c_str(), 0755);
+        if (access(cacheDir().c_str(), W_OK) == 0) {
+            try {
+                malValueVec* entry =
+                    new malValueVec { mal::string(key), forms };
+                serializeFile(cached, mal::vector(entry));
+            }
+            catch (String&) { }
+        }
+    }
+    return forms;
+}
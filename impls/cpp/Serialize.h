@@ -0,0 +1,32 @@
+#ifndef INCLUDE_SERIALIZE_H
+#define INCLUDE_SERIALIZE_H
+
+#include "Types.h"
+
+// A compact binary encoding of mal values. Everything reachable from a
+// value is written, including the environments closures were made in,
+// but the global environment is only referred to: decoding resolves it to
+// the global environment of the interpreter doing the decoding. Builtins
+// are written by name. Values reached more than once are written once and
+// referred back to, so shared structure and cycles survive a round trip.
+//
+// Atoms and refs are written with their current values, and memoized
+// functions without their caches. Channels, promises and futures can't be
+// written.
+
+String serialize(malValuePtr value);
+malValuePtr deserialize(const char* data, size_t size, malEnvPtr globals);
+
+void serializeFile(const String& path, malValuePtr value);
+malValuePtr deserializeFile(const String& path, malEnvPtr globals);
+
+// An image holds every binding of the global environment. Loading one sets
+// them all in env, so it can stand in for the prelude.
+void saveImage(const String& path, malEnvPtr env);
+void loadImage(const String& path, malEnvPtr env);
+
+// Reads every form in a file, as (do forms... nil). Parsed files are kept
+// in a cache on disk, so each is only parsed again once it has changed.
+malValuePtr readFile(const String& path);
+
+#endif // INCLUDE_SERIALIZE_H
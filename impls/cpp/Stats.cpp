@@ -0,0 +1,423 @@
+#include "Stats.h"
+#include "Types.h"
+
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <mutex>
+#include <thread>
+
+#include <unistd.h>
+
+thread_local RuntimeStats::Counters* RuntimeStats::t_counters = NULL;
+thread_local RefCounted::LastNew     RefCounted::t_lastNew = { NULL, 0 };
+
+// Blocks are never freed, so the counts of threads which have finished are
+// kept. Values are counted while other files are still being initialised,
+// so the list is made on first use.
+static std::mutex& countersMutex()
+{
+    static std::mutex* mutex = new std::mutex;
+    return *mutex;
+}
+
+static std::vector<RuntimeStats::Counters*>& allCounters()
+{
+    static std::vector<RuntimeStats::Counters*>* counters =
+        new std::vector<RuntimeStats::Counters*>;
+    return *counters;
+}
+
+// The sums as they were at the last reset.
+struct Totals {
+    Totals() : counts(), lookups() { }
+
+    uint64_t                                counts[RuntimeStats::counterCount];
+    uint64_t                                lookups[RuntimeStats::lookupDepths];
+    std::map<String, uint64_t>              allocated;
+    std::map<String, uint64_t>              freed;
+};
+
+static Totals s_baseline;
+
+RuntimeStats::Counters* RuntimeStats::newCounters()
+{
+    t_counters = new Counters();
+    std::lock_guard<std::mutex> lock(countersMutex());
+    allCounters().push_back(t_counters);
+    return t_counters;
+}
+
+// Builtins are made while other files are being initialised, too.
+static std::vector<String>& builtInNames()
+{
+    static std::vector<String>* names = [] {
+        std::vector<String>* names = new std::vector<String>;
+        names->reserve(RuntimeStats::maxBuiltIns);
+        return names;
+    }();
+    return *names;
+}
+
+int RuntimeStats::registerBuiltIn(const String& name)
+{
+    std::lock_guard<std::mutex> lock(countersMutex());
+    std::vector<String>& names = builtInNames();
+    if (names.size() >= maxBuiltIns) {
+        return -1;
+    }
+    names.push_back(name);
+    return names.size() - 1;
+}
+
+const char* RuntimeStats::builtInName(int index)
+{
+    return builtInNames()[index].c_str();
+}
+
+RuntimeStats::BuiltInTimer::~BuiltInTimer()
+{
+    Counters* c = counters();
+    bump(c->builtinTimed[m_index]);
+    uint64_t nanos = std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now() - m_start).count();
+    c->builtinNanos[m_index].store(
+        c->builtinNanos[m_index].load(std::memory_order_relaxed) + nanos,
+        std::memory_order_relaxed);
+}
+
+static RuntimeStats::Counters::TypeCounts&
+typeCounts(RuntimeStats::Counters* counters, const std::type_info& type)
+{
+    typedef RuntimeStats::Counters Counters;
+    size_t slot = (reinterpret_cast<uintptr_t>(&type) >> 4) %
+                  Counters::typeSlots;
+    for (;;) {
+        Counters::TypeCounts& counts = counters->types[slot];
+        const std::type_info* slotType =
+            counts.type.load(std::memory_order_relaxed);
+        if (slotType == &type) {
+            return counts;
+        }
+        if (slotType == NULL) {
+            counts.type.store(&type, std::memory_order_release);
+            return counts;
+        }
+        slot = (slot + 1) % Counters::typeSlots;
+    }
+}
+
+void RuntimeStats::countAllocated(const std::type_info& type, size_t size)
+{
+    Counters::TypeCounts& counts = typeCounts(counters(), type);
+    bump(counts.allocated);
+    if (size == 0) {
+        size = counts.size.load(std::memory_order_relaxed);
+    }
+    else if (counts.size.load(std::memory_order_relaxed) == 0) {
+        counts.size.store(size, std::memory_order_relaxed);
+    }
+    counts.allocatedBytes.store(
+        counts.allocatedBytes.load(std::memory_order_relaxed) + size,
+        std::memory_order_relaxed);
+}
+
+void RuntimeStats::countFreed(const std::type_info& type)
+{
+    bump(typeCounts(counters(), type).freed);
+}
+
+static void addAllocations(const RuntimeStats::Counters* counters,
+                           uint64_t& objects, uint64_t& bytes)
+{
+    for (auto& counts : counters->types) {
+        objects += counts.allocated.load(std::memory_order_relaxed);
+        bytes += counts.allocatedBytes.load(std::memory_order_relaxed);
+    }
+}
+
+void RuntimeStats::threadAllocations(uint64_t& objects, uint64_t& bytes)
+{
+    objects = bytes = 0;
+    addAllocations(counters(), objects, bytes);
+}
+
+void RuntimeStats::allocations(uint64_t& objects, uint64_t& bytes)
+{
+    objects = bytes = 0;
+    std::lock_guard<std::mutex> lock(countersMutex());
+    for (auto counters : allCounters()) {
+        addAllocations(counters, objects, bytes);
+    }
+}
+
+void RefCounted::noteLastUse(const RefCounted* object)
+{
+    RuntimeStats::countFreed(typeid(*object));
+}
+
+// Called with the counters lock held.
+static Totals sum()
+{
+    Totals totals;
+    for (auto counters : allCounters()) {
+        for (int i = 0; i < RuntimeStats::counterCount; i++) {
+            totals.counts[i] +=
+                counters->counts[i].load(std::memory_order_relaxed);
+        }
+        for (int i = 0; i < RuntimeStats::lookupDepths; i++) {
+            totals.lookups[i] +=
+                counters->lookups[i].load(std::memory_order_relaxed);
+        }
+        for (auto& counts : counters->types) {
+            const std::type_info* type =
+                counts.type.load(std::memory_order_acquire);
+            if (type != NULL) {
+                String name = demangle(type->name());
+                totals.allocated[name] +=
+                    counts.allocated.load(std::memory_order_relaxed);
+                totals.freed[name] +=
+                    counts.freed.load(std::memory_order_relaxed);
+            }
+        }
+    }
+    return totals;
+}
+
+void RuntimeStats::reset()
+{
+    std::lock_guard<std::mutex> lock(countersMutex());
+    s_baseline = sum();
+}
+
+static malValuePtr typeMap(const std::map<String, uint64_t>& totals,
+                           const std::map<String, uint64_t>& baseline)
+{
+    malValueVec items;
+    for (auto& it : totals) {
+        auto base = baseline.find(it.first);
+        uint64_t count = it.second -
+                         (base == baseline.end() ? 0 : base->second);
+        if (count > 0) {
+            items.push_back(mal::string(it.first));
+            items.push_back(mal::integer(count));
+        }
+    }
+    return mal::hash(items.begin(), items.end(), true);
+}
+
+malValuePtr RuntimeStats::report()
+{
+    static const char* names[counterCount] = {
+        ":eval-steps", ":lambda-calls", ":tail-calls", ":builtin-calls",
+        ":macro-expansions", ":envs-created", ":exceptions-thrown",
+        ":exceptions-caught",
+    };
+
+    Totals totals, baseline;
+    {
+        std::lock_guard<std::mutex> lock(countersMutex());
+        totals = sum();
+        baseline = s_baseline;
+    }
+
+    malValueVec stats;
+    for (int i = 0; i < counterCount; i++) {
+        stats.push_back(mal::keyword(names[i]));
+        stats.push_back(mal::integer(totals.counts[i] - baseline.counts[i]));
+    }
+    malValueVec* lookups = new malValueVec;
+    for (int i = 0; i < lookupDepths; i++) {
+        lookups->push_back(mal::integer(totals.lookups[i] -
+                                        baseline.lookups[i]));
+    }
+    stats.push_back(mal::keyword(":env-lookup-depths"));
+    stats.push_back(mal::vector(lookups));
+    stats.push_back(mal::keyword(":allocated"));
+    stats.push_back(typeMap(totals.allocated, baseline.allocated));
+    stats.push_back(mal::keyword(":freed"));
+    stats.push_back(typeMap(totals.freed, baseline.freed));
+    return mal::hash(stats.begin(), stats.end(), true);
+}
+
+struct TypeMetrics {
+    TypeMetrics() : allocated(0), freed(0), size(0) { }
+
+    uint64_t    allocated;
+    uint64_t    freed;
+    size_t      size;
+};
+
+static void metric(String& text, const char* name, const char* type,
+                   const char* help)
+{
+    text += STRF("# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+String RuntimeStats::metrics()
+{
+    static const char* names[counterCount][2] = {
+        { "mal_eval_steps_total", "Iterations of the EVAL loop." },
+        { "mal_lambda_calls_total", "Calls of mal functions." },
+        { "mal_tail_calls_total", "Calls of mal functions in tail position." },
+        { "mal_builtin_calls_total", "Calls of builtins." },
+        { "mal_macro_expansions_total", "Macro expansions." },
+        { "mal_envs_created_total", "Environments created." },
+        { "mal_exceptions_thrown_total", "Exceptions thrown." },
+        { "mal_exceptions_caught_total", "Exceptions caught by try*." },
+    };
+
+    uint64_t counts[counterCount] = { };
+    uint64_t lookups[lookupDepths] = { };
+    std::map<String, TypeMetrics> types;
+    std::vector<String> builtins;
+    std::vector<uint64_t> calls, timed, nanos;
+    {
+        std::lock_guard<std::mutex> lock(countersMutex());
+        builtins = builtInNames();
+        calls.resize(builtins.size());
+        timed.resize(builtins.size());
+        nanos.resize(builtins.size());
+        for (auto c : allCounters()) {
+            for (int i = 0; i < counterCount; i++) {
+                counts[i] += c->counts[i].load(std::memory_order_relaxed);
+            }
+            for (int i = 0; i < lookupDepths; i++) {
+                lookups[i] += c->lookups[i].load(std::memory_order_relaxed);
+            }
+            for (auto& counts : c->types) {
+                const std::type_info* type =
+                    counts.type.load(std::memory_order_acquire);
+                if (type != NULL) {
+                    TypeMetrics& metrics = types[demangle(type->name())];
+                    metrics.allocated +=
+                        counts.allocated.load(std::memory_order_relaxed);
+                    metrics.freed +=
+                        counts.freed.load(std::memory_order_relaxed);
+                    metrics.size = std::max(metrics.size,
+                        counts.size.load(std::memory_order_relaxed));
+                }
+            }
+            for (size_t i = 0; i < builtins.size(); i++) {
+                calls[i] += c->builtinCalls[i].load(std::memory_order_relaxed);
+                timed[i] += c->builtinTimed[i].load(std::memory_order_relaxed);
+                nanos[i] += c->builtinNanos[i].load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+    String text;
+    for (int i = 0; i < counterCount; i++) {
+        metric(text, names[i][0], "counter", names[i][1]);
+        text += STRF("%s %llu\n", names[i][0], (unsigned long long)counts[i]);
+    }
+
+    metric(text, "mal_env_lookups_total", "counter",
+           "malEnv::get calls, by how many outer environments were walked.");
+    for (int i = 0; i < lookupDepths; i++) {
+        text += STRF("mal_env_lookups_total{depth=\"%d%s\"} %llu\n", i,
+                     i == lookupDepths - 1 ? "+" : "",
+                     (unsigned long long)lookups[i]);
+    }
+
+    // Freeing is counted before the object goes, so live counts may briefly
+    // be one short, but never negative.
+    metric(text, "mal_objects_allocated_total", "counter",
+           "Reference counted objects allocated, by type.");
+    for (auto& it : types) {
+        text += STRF("mal_objects_allocated_total{type=\"%s\"} %llu\n",
+                     it.first.c_str(),
+                     (unsigned long long)it.second.allocated);
+    }
+    metric(text, "mal_objects_freed_total", "counter",
+           "Reference counted objects freed, by type.");
+    for (auto& it : types) {
+        text += STRF("mal_objects_freed_total{type=\"%s\"} %llu\n",
+                     it.first.c_str(), (unsigned long long)it.second.freed);
+    }
+    metric(text, "mal_objects_live", "gauge",
+           "Reference counted objects live, by type.");
+    for (auto& it : types) {
+        const TypeMetrics& metrics = it.second;
+        uint64_t live = metrics.allocated > metrics.freed
+                      ? metrics.allocated - metrics.freed : 0;
+        text += STRF("mal_objects_live{type=\"%s\"} %llu\n",
+                     it.first.c_str(), (unsigned long long)live);
+    }
+    metric(text, "mal_heap_bytes", "gauge",
+           "Bytes held by live objects themselves, by type, not counting "
+           "the containers they own.");
+    for (auto& it : types) {
+        const TypeMetrics& metrics = it.second;
+        uint64_t live = metrics.allocated > metrics.freed
+                      ? metrics.allocated - metrics.freed : 0;
+        text += STRF("mal_heap_bytes{type=\"%s\"} %llu\n",
+                     it.first.c_str(),
+                     (unsigned long long)(live * metrics.size));
+    }
+
+    // A builtin may be made more than once under a name, as by swap!.
+    std::map<String, uint64_t> callsByName, timedByName, nanosByName;
+    for (size_t i = 0; i < builtins.size(); i++) {
+        callsByName[builtins[i]] += calls[i];
+        timedByName[builtins[i]] += timed[i];
+        nanosByName[builtins[i]] += nanos[i];
+    }
+    metric(text, "mal_builtin_calls_by_name_total", "counter",
+           "Calls of each builtin.");
+    for (auto& it : callsByName) {
+        if (it.second > 0) {
+            text += STRF("mal_builtin_calls_by_name_total{builtin=%s} %llu\n",
+                         escape(it.first).c_str(),
+                         (unsigned long long)it.second);
+        }
+    }
+    metric(text, "mal_builtin_call_seconds", "summary",
+           "Time spent in each builtin, over a sample of its calls.");
+    for (auto& it : timedByName) {
+        if (it.second > 0) {
+            String label = escape(it.first);
+            text += STRF("mal_builtin_call_seconds_sum{builtin=%s} %.9f\n"
+                         "mal_builtin_call_seconds_count{builtin=%s} %llu\n",
+                         label.c_str(), nanosByName[it.first] / 1e9,
+                         label.c_str(), (unsigned long long)it.second);
+        }
+    }
+    return text;
+}
+
+// Written alongside and renamed into place, so that the collector never
+// reads half a file.
+void RuntimeStats::writeMetrics(const String& path)
+{
+    static std::mutex mutex;
+    std::lock_guard<std::mutex> lock(mutex);
+    String tempPath = STRF("%s.%d.tmp", path.c_str(), getpid());
+    {
+        std::ofstream file(tempPath.c_str(), std::ios::out | std::ios::binary);
+        MAL_CHECK(!file.fail(), "Cannot open %s", tempPath.c_str());
+        file << metrics();
+        MAL_CHECK(!file.fail(), "Cannot write %s", tempPath.c_str());
+    }
+    MAL_CHECK(rename(tempPath.c_str(), path.c_str()) == 0,
+              "Cannot write %s: %s", path.c_str(), strerror(errno));
+}
+
+void RuntimeStats::exportMetrics(const String& path, int intervalSeconds)
+{
+    MAL_CHECK(intervalSeconds > 0, "The metrics interval must be positive");
+    std::thread([path, intervalSeconds] {
+        for (;;) {
+            try {
+                writeMetrics(path);
+            }
+            catch (String& s) {
+                std::cerr << "Error writing metrics: " << s << "\n";
+            }
+            std::this_thread::sleep_for(std::chrono::seconds(intervalSeconds));
+        }
+    }).detach();
+}
@@ -0,0 +1,139 @@
+#ifndef INCLUDE_STATS_H
+#define INCLUDE_STATS_H
+
+#include "MAL.h"
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <typeinfo>
+
+// Counters of what the interpreter does, which are always on. Each thread
+// counts into a block of its own, so a count is a plain load and store, and
+// reading them sums the blocks. Resetting them only notes the current sums,
+// so it never loses a count.
+class RuntimeStats {
+public:
+    enum Counter {
+        EvalSteps,          // iterations of stepA's EVAL loop
+        LambdaCalls,
+        TailCalls,          // lambda calls which replaced their caller
+        BuiltInCalls,
+        MacroExpansions,
+        EnvsCreated,
+        ExceptionsThrown,   // by throw, or by the interpreter itself
+        ExceptionsCaught,   // by try*
+        counterCount
+    };
+
+    // malEnv::get walks of each length, the last of which counts the walks
+    // that long or longer.
+    enum { lookupDepths = 8 };
+
+    // Builtins are counted by name, and one call in every timingInterval
+    // is timed, which keeps reading the clock off the EVAL path.
+    enum { maxBuiltIns = 512, timingInterval = 64 };
+
+    struct Counters {
+        // There are far fewer types of object than slots.
+        enum { typeSlots = 64 };
+
+        struct TypeCounts {
+            std::atomic<const std::type_info*>  type;
+            std::atomic<uint64_t>               allocated;
+            std::atomic<uint64_t>               allocatedBytes;
+            std::atomic<uint64_t>               freed;
+            std::atomic<size_t>                 size; // 0 until seen
+        };
+
+        std::atomic<uint64_t>   counts[counterCount];
+        std::atomic<uint64_t>   lookups[lookupDepths];
+        TypeCounts              types[typeSlots];
+        std::atomic<uint64_t>   builtinCalls[maxBuiltIns];
+        std::atomic<uint64_t>   builtinTimed[maxBuiltIns];
+        std::atomic<uint64_t>   builtinNanos[maxBuiltIns];
+    };
+
+    static void count(Counter counter) {
+        bump(counters()->counts[counter]);
+    }
+
+    static void countLookup(int depth) {
+        bump(counters()->lookups[depth < lookupDepths ? depth
+                                                      : lookupDepths - 1]);
+    }
+
+    // Returns true if this call is one to be timed. Each builtin's calls
+    // are sampled by its own count, so that one called in step with others
+    // doesn't always, or never, land on a timed call.
+    static bool countBuiltInCall(int index) {
+        Counters* c = counters();
+        bump(c->counts[BuiltInCalls]);
+        if (index < 0) {
+            return false;
+        }
+        std::atomic<uint64_t>& calls = c->builtinCalls[index];
+        uint64_t count = calls.load(std::memory_order_relaxed);
+        calls.store(count + 1, std::memory_order_relaxed);
+        return (count % timingInterval) == 0;
+    }
+
+    // Returns the index to count calls of a builtin under, or -1 if there
+    // are too many builtins to count them all.
+    static int registerBuiltIn(const String& name);
+
+    // The name registered under index. It stays put, so it can be read at
+    // any time without locking.
+    static const char* builtInName(int index);
+
+    class BuiltInTimer {
+    public:
+        BuiltInTimer(int index)
+        : m_index(index), m_start(std::chrono::steady_clock::now()) { }
+        ~BuiltInTimer();
+
+    private:
+        int                                     m_index;
+        std::chrono::steady_clock::time_point   m_start;
+    };
+
+    // The size is that of the object, if known. If not, the size last seen
+    // of its type is counted.
+    static void countAllocated(const std::type_info& type, size_t size);
+    static void countFreed(const std::type_info& type);
+
+    // The objects allocated by this thread so far, and their total size as
+    // counted when they were allocated.
+    static void threadAllocations(uint64_t& objects, uint64_t& bytes);
+
+    // The same, summed over every thread.
+    static void allocations(uint64_t& objects, uint64_t& bytes);
+
+    // A map of the counts since the last reset.
+    static malValuePtr report();
+    static void reset();
+
+    // The counts since the interpreter started, in the Prometheus text
+    // format, for long-running interpreters to be monitored through.
+    static String metrics();
+
+    // Writes the metrics to a file every so often from a thread of its
+    // own, as read by node_exporter's textfile collector.
+    static void exportMetrics(const String& path, int intervalSeconds);
+    static void writeMetrics(const String& path);
+
+private:
+    static void bump(std::atomic<uint64_t>& counter) {
+        counter.store(counter.load(std::memory_order_relaxed) + 1,
+                      std::memory_order_relaxed);
+    }
+
+    static Counters* counters() {
+        return t_counters != NULL ? t_counters : newCounters();
+    }
+    static Counters* newCounters();
+
+    static thread_local Counters* t_counters;
+};
+
+#endif // INCLUDE_STATS_H
@@ -1,6 +1,7 @@
 #include "Debug.h"
 #include "String.h"
 
+#include <cxxabi.h>
 #include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -35,6 +36,13 @@ String copyAndFree(char* mallocedString)
     return ret;
 }
 
+String demangle(const char* typeName)
+{
+    int status;
+    char* demangled = abi::__cxa_demangle(typeName, NULL, NULL, &status);
+    return status == 0 ? copyAndFree(demangled) : String(typeName);
+}
+
 String escape(const String& in)
 {
     String out;
@@ -54,6 +62,35 @@ String escape(const String& in)
     return out;
 }
 
+// As escape, but JSON also needs every other control character escaped.
+String jsonEscape(const String& in)
+{
+    String out;
+    out.reserve(in.size() * 2 + 2);
+    out += '"';
+    for (char c : in) {
+        switch (c) {
+            case '\\': out += "\\\\"; break;
+            case '"':  out += "\\\""; break;
+            case '\n': out += "\\n"; break;
+            case '\t': out += "\\t"; break;
+            case '\r': out += "\\r"; break;
+            case '\b': out += "\\b"; break;
+            case '\f': out += "\\f"; break;
+            default:
+                if ((unsigned char)c < 0x20) {
+                    out += STRF("\\u%04x", c);
+                }
+                else {
+                    out += c;
+                }
+                break;
+        }
+    }
+    out += '"';
+    return out;
+}
+
 static char unescape(char c)
 {
     switch (c) {
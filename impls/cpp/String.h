@@ -12,7 +12,9 @@ typedef std::vector<String> StringVec;
 
 extern String stringPrintf(const char* fmt, ...);
 extern String copyAndFree(char* mallocedString);
+extern String demangle(const char* typeName);
 extern String escape(const String& s);
+extern String jsonEscape(const String& s);
 extern String unescape(const String& s);
 
 #endif // INCLUDE_STRING_H
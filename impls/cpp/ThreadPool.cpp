@@ -0,0 +1,205 @@
+#include "ThreadPool.h"
+#include "Debug.h"
+#include "RefCountedPtr.h"
+#include "STM.h"
+
+#include <algorithm>
+#include <cstdlib>
+
+std::atomic<int> RefCounted::s_sharingCount(0);
+
+static thread_local int t_workerIndex = -1;
+static thread_local int t_taskDepth = 0;
+
+ThreadPool& ThreadPool::instance()
+{
+    // The calling thread helps out while it waits, so it gets a core too.
+    // The pool is never destroyed, as workers may still be waiting at exit.
+    static ThreadPool* pool = [] {
+        ThreadPool* pool = new ThreadPool(
+            std::max(1, (int)std::thread::hardware_concurrency() - 1));
+        // This runs before the destructors of statics made before the
+        // pool, such as the global environment.
+        atexit(&ThreadPool::drainAtExit);
+        return pool;
+    }();
+    return *pool;
+}
+
+void ThreadPool::drainAtExit()
+{
+    ThreadPool& pool = instance();
+    while (pool.m_detachedCount.load(std::memory_order_acquire) > 0) {
+        if (!pool.runOne()) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+    }
+}
+
+ThreadPool::ThreadPool(int workerCount)
+: m_queuedCount(0)
+, m_detachedCount(0)
+{
+    for (int i = 0; i <= workerCount; i++) {
+        m_queues.push_back(new Queue);
+    }
+    for (int i = 0; i < workerCount; i++) {
+        m_threads.push_back(std::thread(&ThreadPool::workerMain, this, i));
+    }
+}
+
+bool ThreadPool::isInTask()
+{
+    return t_taskDepth > 0;
+}
+
+void ThreadPool::spawn(TaskGroup& group, const Task& task)
+{
+    RefCounted::startSharing();
+
+    Job* job = new Job;
+    job->task = task;
+    job->group = &group;
+    group.m_pending++;
+    push(job);
+}
+
+void ThreadPool::spawn(const Task& task)
+{
+    RefCounted::startSharing();
+
+    Job* job = new Job;
+    job->task = task;
+    job->group = NULL;
+    m_detachedCount++;
+    push(job);
+}
+
+void ThreadPool::push(Job* job)
+{
+    int index = (t_workerIndex >= 0) ? t_workerIndex : size();
+    Queue* queue = m_queues[index];
+    {
+        std::lock_guard<std::mutex> lock(queue->mutex);
+        queue->jobs.push_back(job);
+    }
+
+    m_queuedCount++;
+    {
+        // Don't let a worker miss the wake up between checking the count
+        // and going to sleep.
+        std::lock_guard<std::mutex> lock(m_sleepMutex);
+    }
+    m_wakeUp.notify_one();
+}
+
+// With nothing to help with, the waiter sleeps until the group is done,
+// looking for new work every millisecond rather than spinning.
+void ThreadPool::wait(TaskGroup& group)
+{
+    while (group.m_pending.load(std::memory_order_acquire) > 0) {
+        if (runOne()) {
+            continue;
+        }
+        std::unique_lock<std::mutex> lock(group.m_mutex);
+        group.m_done.wait_for(lock, std::chrono::milliseconds(1), [&] {
+            return group.m_pending.load(std::memory_order_acquire) == 0;
+        });
+    }
+    // The last task notifies with the lock held, so once it's been taken
+    // nothing will touch the group again.
+    std::lock_guard<std::mutex> lock(group.m_mutex);
+    if (group.m_error) {
+        std::rethrow_exception(group.m_error);
+    }
+}
+
+bool ThreadPool::runOne()
+{
+    Job* job = take();
+    if (job == NULL) {
+        return false;
+    }
+    run(job);
+    return true;
+}
+
+ThreadPool::Job* ThreadPool::take()
+{
+    const int self = t_workerIndex;
+    const int queueCount = m_queues.size();
+    Job* job = NULL;
+
+    // Newest of our own first, as it's most likely to still be in cache.
+    if (self >= 0) {
+        Queue* queue = m_queues[self];
+        std::lock_guard<std::mutex> lock(queue->mutex);
+        if (!queue->jobs.empty()) {
+            job = queue->jobs.back();
+            queue->jobs.pop_back();
+        }
+    }
+
+    // Otherwise steal the oldest, which is likely to be the largest.
+    for (int i = 1; (job == NULL) && (i <= queueCount); i++) {
+        int index = (std::max(self, 0) + i) % queueCount;
+        if (index == self) {
+            continue;
+        }
+        Queue* queue = m_queues[index];
+        std::lock_guard<std::mutex> lock(queue->mutex);
+        if (!queue->jobs.empty()) {
+            job = queue->jobs.front();
+            queue->jobs.pop_front();
+        }
+    }
+
+    if (job != NULL) {
+        m_queuedCount--;
+    }
+    return job;
+}
+
+void ThreadPool::run(Job* job)
+{
+    TaskGroup* group = job->group;
+
+    ++t_taskDepth;
+    try {
+        Transaction::Suspend suspend;
+        job->task();
+    }
+    catch (...) {
+        ASSERT(group != NULL, "Uncaught exception in a detached task\n");
+        std::lock_guard<std::mutex> lock(group->m_mutex);
+        if (!group->m_error) {
+            group->m_error = std::current_exception();
+        }
+    }
+    --t_taskDepth;
+    delete job;
+
+    if (group != NULL) {
+        std::lock_guard<std::mutex> lock(group->m_mutex);
+        if (group->m_pending.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+            group->m_done.notify_all();
+        }
+    }
+    else {
+        m_detachedCount.fetch_sub(1, std::memory_order_release);
+    }
+    RefCounted::stopSharing();
+}
+
+void ThreadPool::workerMain(int index)
+{
+    t_workerIndex = index;
+    while (1) {
+        if (Job* job = take()) {
+            run(job);
+            continue;
+        }
+        std::unique_lock<std::mutex> lock(m_sleepMutex);
+        m_wakeUp.wait(lock, [this] { return m_queuedCount > 0; });
+    }
+}
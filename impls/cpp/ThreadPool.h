@@ -0,0 +1,85 @@
+#ifndef INCLUDE_THREADPOOL_H
+#define INCLUDE_THREADPOOL_H
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// A set of tasks which are waited for together. The first exception thrown
+// by any of them is rethrown by ThreadPool::wait.
+class TaskGroup {
+public:
+    TaskGroup() : m_pending(0) { }
+
+private:
+    friend class ThreadPool;
+
+    TaskGroup(const TaskGroup&); // no copy ctor
+    TaskGroup& operator = (const TaskGroup&); // no assignments
+
+    std::atomic<int>            m_pending;
+    std::mutex                  m_mutex;
+    std::condition_variable     m_done;     // notified when pending is 0
+    std::exception_ptr          m_error;
+};
+
+// A work-stealing pool, with one worker per core. Each worker has its own
+// deque of tasks: it takes new work from the back of its own deque, and
+// steals the oldest work from the front of the others'. Threads waiting on
+// a TaskGroup run queued tasks until it is complete, so nested fork-join
+// parallelism cannot deadlock the pool.
+class ThreadPool {
+public:
+    typedef std::function<void()> Task;
+
+    static ThreadPool& instance();
+
+    int size() const { return m_threads.size(); }
+
+    void spawn(TaskGroup& group, const Task& task);
+    void wait(TaskGroup& group);
+
+    // Queues a task which nobody waits for. It must handle any exceptions
+    // itself. The process waits for these to finish when it exits, before
+    // anything they may use is destroyed.
+    void spawn(const Task& task);
+
+    // Runs one queued task on the calling thread, if there are any.
+    bool runOne();
+
+    // True while the calling thread is running a task from the pool.
+    static bool isInTask();
+
+private:
+    struct Job {
+        Task        task;
+        TaskGroup*  group;
+    };
+
+    struct Queue {
+        std::mutex       mutex;
+        std::deque<Job*> jobs;
+    };
+
+    ThreadPool(int workerCount);
+
+    void push(Job* job);
+    static void drainAtExit();
+    void workerMain(int index);
+    Job* take();
+    void run(Job* job);
+
+    std::vector<Queue*>       m_queues; // the last is shared by non-workers
+    std::vector<std::thread>  m_threads;
+    std::atomic<int>          m_queuedCount;
+    std::atomic<int>          m_detachedCount; // queued or running
+    std::mutex                m_sleepMutex;
+    std::condition_variable   m_wakeUp;
+};
+
+#endif // INCLUDE_THREADPOOL_H
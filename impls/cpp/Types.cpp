@@ -1,9 +1,13 @@
 #include "Debug.h"
 #include "Environment.h"
+#include "Profiler.h"
+#include "ThreadPool.h"
 #include "Types.h"
 
 #include <algorithm>
+#include <chrono>
 #include <memory>
+#include <thread>
 #include <typeinfo>
 
 namespace mal {
@@ -19,12 +23,22 @@ namespace mal {
         return malValuePtr(new malBuiltIn(name, handler));
     };
 
-    malValuePtr falseValue() {
+    malValuePtr channel(int capacity) {
+        return malValuePtr(new malChannel(capacity));
+    }
+
+    const malValuePtr& falseValue() {
         static malValuePtr c(new malConstant("false"));
-        return malValuePtr(c);
+        return c;
     };
 
 
+    malValuePtr future(malValuePtr op) {
+        malValuePtr future(new malFuture);
+        malFuture::start(future, op);
+        return future;
+    }
+
     malValuePtr hash(const malHash::Map& map) {
         return malValuePtr(new malHash(map));
     }
@@ -84,11 +98,23 @@ namespace mal {
         return malValuePtr(new malLambda(lambda, true));
     };
 
-    malValuePtr nilValue() {
+    malValuePtr memoize(malValuePtr op, size_t limit) {
+        return malValuePtr(new malMemoized(op, limit));
+    }
+
+    const malValuePtr& nilValue() {
         static malValuePtr c(new malConstant("nil"));
-        return malValuePtr(c);
+        return c;
     };
 
+    malValuePtr promise() {
+        return malValuePtr(new malPromise);
+    }
+
+    malValuePtr ref(malValuePtr value) {
+        return malValuePtr(new malRef(value));
+    }
+
     malValuePtr string(const String& token) {
         return malValuePtr(new malString(token));
     }
@@ -97,9 +123,27 @@ namespace mal {
         return malValuePtr(new malSymbol(token));
     };
 
-    malValuePtr trueValue() {
+    malValuePtr tailCall(malValueVec call, malValueVec then) {
+        return malValuePtr(new malTailCall(std::move(call), std::move(then)));
+    }
+
+    malValuePtr transducer(malTransducer::Kind kind, malValuePtr op) {
+        malTransducer::Stage stage = { kind, op, 0 };
+        return malValuePtr(new malTransducer(malTransducer::Stages(1, stage)));
+    }
+
+    malValuePtr transducer(malTransducer::Kind kind, int64_t count) {
+        malTransducer::Stage stage = { kind, malValuePtr(), count };
+        return malValuePtr(new malTransducer(malTransducer::Stages(1, stage)));
+    }
+
+    malValuePtr transducer(const malTransducer::Stages& stages) {
+        return malValuePtr(new malTransducer(stages));
+    }
+
+    const malValuePtr& trueValue() {
         static malValuePtr c(new malConstant("true"));
-        return malValuePtr(c);
+        return c;
     };
 
     malValuePtr vector(malValueVec* items) {
@@ -114,18 +158,7 @@ namespace mal {
 malValuePtr malBuiltIn::apply(malValueIter argsBegin,
                               malValueIter argsEnd) const
 {
-    return m_handler(m_name, argsBegin, argsEnd);
-}
-
-static String makeHashKey(malValuePtr key)
-{
-    if (const malString* skey = DYNAMIC_CAST(malString, key)) {
-        return skey->print(true);
-    }
-    else if (const malKeyword* kkey = DYNAMIC_CAST(malKeyword, key)) {
-        return kkey->print(true);
-    }
-    MAL_FAIL("%s is not a string or keyword", key->print(true).c_str());
+    return malTailCall::resolve(applyTail(argsBegin, argsEnd));
 }
 
 static malHash::Map addToMap(malHash::Map& map,
@@ -133,7 +166,7 @@ static malHash::Map addToMap(malHash::Map& map,
 {
     // This is intended to be called with pre-evaluated arguments.
     for (auto it = argsBegin; it != argsEnd; ++it) {
-        String key = makeHashKey(*it++);
+        malValuePtr key = *it++;
         map[key] = *it;
     }
 
@@ -175,8 +208,7 @@ malHash::assoc(malValueIter argsBegin, malValueIter argsEnd) const
 
 bool malHash::contains(malValuePtr key) const
 {
-    auto it = m_map.find(makeHashKey(key));
-    return it != m_map.end();
+    return m_map.find(key) != m_map.end();
 }
 
 malValuePtr
@@ -184,13 +216,12 @@ malHash::dissoc(malValueIter argsBegin, malValueIter argsEnd) const
 {
     malHash::Map map(m_map);
     for (auto it = argsBegin; it != argsEnd; ++it) {
-        String key = makeHashKey(*it);
-        map.erase(key);
+        map.erase(*it);
     }
     return mal::hash(map);
 }
 
-malValuePtr malHash::eval(malEnvPtr env)
+malValuePtr malHash::eval(const malEnvPtr& env)
 {
     if (m_isEvaluated) {
         return malValuePtr(this);
@@ -198,14 +229,14 @@ malValuePtr malHash::eval(malEnvPtr env)
 
     malHash::Map map;
     for (auto it = m_map.begin(), end = m_map.end(); it != end; ++it) {
-        map[it->first] = EVAL(it->second, env);
+        map[EVAL(it->first, env)] = EVAL(it->second, env);
     }
     return mal::hash(map);
 }
 
 malValuePtr malHash::get(malValuePtr key) const
 {
-    auto it = m_map.find(makeHashKey(key));
+    auto it = m_map.find(key);
     return it == m_map.end() ? mal::nilValue() : it->second;
 }
 
@@ -214,16 +245,29 @@ malValuePtr malHash::keys() const
     malValueVec* keys = new malValueVec();
     keys->reserve(m_map.size());
     for (auto it = m_map.begin(), end = m_map.end(); it != end; ++it) {
-        if (it->first[0] == '"') {
-            keys->push_back(mal::string(unescape(it->first)));
-        }
-        else {
-            keys->push_back(mal::keyword(it->first));
-        }
+        keys->push_back(it->first);
     }
     return mal::list(keys);
 }
 
+size_t malHash::hash() const
+{
+    if (size_t hash = m_hash.get()) {
+        return hash;
+    }
+
+    // Equal maps may be ordered differently, so the entries are combined
+    // with an addition.
+    size_t hash = 2;
+    for (auto it = m_map.begin(), end = m_map.end(); it != end; ++it) {
+        uint64_t entry = it->first->hash() * 31 + it->second->hash();
+        entry ^= entry >> 29;
+        entry *= 0xbf58476d1ce4e5b9ULL;
+        hash += entry ^ (entry >> 32);
+    }
+    return m_hash.set(hash);
+}
+
 malValuePtr malHash::values() const
 {
     malValueVec* keys = new malValueVec();
@@ -240,36 +284,55 @@ String malHash::print(bool readably) const
 
     auto it = m_map.begin(), end = m_map.end();
     if (it != end) {
-        s += it->first + " " + it->second->print(readably);
+        s += it->first->print(true) + " " + it->second->print(readably);
         ++it;
     }
     for ( ; it != end; ++it) {
-        s += " " + it->first + " " + it->second->print(readably);
+        s += " " + it->first->print(true) + " " + it->second->print(readably);
     }
 
     return s + "}";
 }
 
-bool malHash::doIsEqualTo(const malValue* rhs) const
+bool malHash::doIsShallowEqualTo(const malValue* rhs,
+                                 EqualityQueue& pending) const
 {
     const malHash::Map& r_map = static_cast<const malHash*>(rhs)->m_map;
     if (m_map.size() != r_map.size()) {
         return false;
     }
 
-    for (auto it0 = m_map.begin(), end0 = m_map.end(), it1 = r_map.begin();
-         it0 != end0; ++it0, ++it1) {
-
-        if (it0->first != it1->first) {
-            return false;
-        }
-        if (!it0->second->isEqualTo(it1->second.ptr())) {
+    for (auto it0 = m_map.begin(), end0 = m_map.end(); it0 != end0; ++it0) {
+        auto it1 = r_map.find(it0->first);
+        if (it1 == r_map.end()) {
             return false;
         }
+        pending.push_back(std::make_pair(it0->second.ptr(),
+                                         it1->second.ptr()));
     }
     return true;
 }
 
+void malFuture::start(malValuePtr self, malValuePtr op)
+{
+    // The task keeps the future alive until it has delivered the result.
+    ThreadPool::instance().spawn([self, op] {
+        malFuture* future = STATIC_CAST(malFuture, self);
+        try {
+            malValueVec noArgs;
+            future->deliver(APPLY(op, noArgs.begin(), noArgs.end()));
+        }
+        catch (...) {
+            future->deliverError(std::current_exception());
+        }
+    });
+}
+
+String malFuture::print(bool readably) const
+{
+    return STRF("#future(%p)", this);
+}
+
 malLambda::malLambda(const StringVec& bindings,
                      malValuePtr body, malEnvPtr env)
 : m_bindings(bindings)
@@ -303,7 +366,10 @@ malLambda::malLambda(const malLambda& that, bool isMacro)
 malValuePtr malLambda::apply(malValueIter argsBegin,
                              malValueIter argsEnd) const
 {
-    return EVAL(m_body, makeEnv(argsBegin, argsEnd));
+    RuntimeStats::count(RuntimeStats::LambdaCalls);
+    malEnvPtr env = makeEnv(argsBegin, argsEnd);
+    CallStack::Entry entry(this);
+    return EVAL(m_body, env);
 }
 
 malValuePtr malLambda::doWithMeta(malValuePtr meta) const
@@ -316,6 +382,62 @@ malEnvPtr malLambda::makeEnv(malValueIter argsBegin, malValueIter argsEnd) const
     return malEnvPtr(new malEnv(m_env, m_bindings, argsBegin, argsEnd));
 }
 
+malMemoized::Key::Key(malValueIter argsBegin, malValueIter argsEnd)
+: args(argsBegin, argsEnd)
+, hash(0)
+{
+    for (auto it = argsBegin; it != argsEnd; ++it) {
+        hash = hash * 31 + (*it)->hash();
+    }
+}
+
+bool malMemoized::KeyEqual::operator()(const Key& lhs, const Key& rhs) const
+{
+    if (lhs.args.size() != rhs.args.size()) {
+        return false;
+    }
+    for (size_t i = 0; i < lhs.args.size(); i++) {
+        if (!lhs.args[i]->isEqualTo(rhs.args[i].ptr())) {
+            return false;
+        }
+    }
+    return true;
+}
+
+malValuePtr malMemoized::apply(malValueIter argsBegin,
+                               malValueIter argsEnd) const
+{
+    Key key(argsBegin, argsEnd);
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        auto it = m_cache.find(key);
+        if (it != m_cache.end()) {
+            if (m_limit != 0) {
+                m_lru.splice(m_lru.begin(), m_lru, it->second.lru);
+            }
+            return it->second.value;
+        }
+    }
+
+    // The lock isn't held while calling the function, as it may well
+    // recurse through here. If two threads compute the same result, the
+    // first one to finish is kept.
+    malValuePtr value = APPLY(m_op, argsBegin, argsEnd);
+
+    std::lock_guard<std::mutex> lock(m_mutex);
+    Entry entry = { value, m_lru.end() };
+    auto inserted = m_cache.emplace(std::move(key), entry);
+    if (inserted.second && m_limit != 0) {
+        m_lru.push_front(&inserted.first->first);
+        inserted.first->second.lru = m_lru.begin();
+        if (m_cache.size() > m_limit) {
+            m_cache.erase(m_cache.find(*m_lru.back()));
+            m_lru.pop_back();
+        }
+    }
+    return inserted.first->second.value;
+}
+
 malValuePtr malList::conj(malValueIter argsBegin,
                           malValueIter argsEnd) const
 {
@@ -329,7 +451,7 @@ malValuePtr malList::conj(malValueIter argsBegin,
     return mal::list(items);
 }
 
-malValuePtr malList::eval(malEnvPtr env)
+malValuePtr malList::eval(const malEnvPtr& env)
 {
     // Note, this isn't actually called since the TCO updates, but
     // is required for the earlier steps, so don't get rid of it.
@@ -348,7 +470,7 @@ String malList::print(bool readably) const
     return '(' + malSequence::print(readably) + ')';
 }
 
-malValuePtr malValue::eval(malEnvPtr env)
+malValuePtr malValue::eval(const malEnvPtr& env)
 {
     // Default case of eval is just to return the object itself.
     return malValuePtr(this);
@@ -356,12 +478,45 @@ malValuePtr malValue::eval(malEnvPtr env)
 
 bool malValue::isEqualTo(const malValue* rhs) const
 {
-    // Special-case. Vectors and Lists can be compared.
-    bool matchingTypes = (typeid(*this) == typeid(*rhs)) ||
-        (dynamic_cast<const malSequence*>(this) &&
-         dynamic_cast<const malSequence*>(rhs));
+    // Pairs still to compare are kept here rather than on the native stack,
+    // so there's no limit to how deep the values can be.
+    EqualityQueue pending;
+    const malValue* lhs = this;
+    while (1) {
+        // Shared structure is equal to itself, without looking inside.
+        if (lhs != rhs) {
+            // Special-case. Vectors and Lists can be compared.
+            bool matchingTypes = (typeid(*lhs) == typeid(*rhs)) ||
+                (dynamic_cast<const malSequence*>(lhs) &&
+                 dynamic_cast<const malSequence*>(rhs));
+            if (!matchingTypes) {
+                return false;
+            }
+
+            // Hashes which have already been computed make for a cheap
+            // test of inequality.
+            size_t lhsHash = lhs->cachedHash(), rhsHash = rhs->cachedHash();
+            if (lhsHash != 0 && rhsHash != 0 && lhsHash != rhsHash) {
+                return false;
+            }
+
+            if (!lhs->doIsShallowEqualTo(rhs, pending)) {
+                return false;
+            }
+        }
 
-    return matchingTypes && doIsEqualTo(rhs);
+        if (pending.empty()) {
+            return true;
+        }
+        lhs = pending.back().first;
+        rhs = pending.back().second;
+        pending.pop_back();
+    }
+}
+
+size_t malValue::hash() const
+{
+    return std::hash<const malValue*>()(this);
 }
 
 bool malValue::isTrue() const
@@ -383,20 +538,26 @@ malValuePtr malValue::withMeta(malValuePtr meta) const
 malSequence::malSequence(malValueVec* items)
 : m_items(items)
 {
-
+    noteItems();
 }
 
 malSequence::malSequence(malValueIter begin, malValueIter end)
 : m_items(new malValueVec(begin, end))
 {
-
+    noteItems();
 }
 
 malSequence::malSequence(const malSequence& that, malValuePtr meta)
 : malValue(meta)
 , m_items(new malValueVec(*(that.m_items)))
 {
+    noteItems();
+}
 
+void malSequence::noteItems() const
+{
+    FlightRecorder::noteAllocation("sequence",
+                                   m_items->size() * sizeof(malValuePtr));
 }
 
 malSequence::~malSequence()
@@ -404,25 +565,37 @@ malSequence::~malSequence()
     delete m_items;
 }
 
-bool malSequence::doIsEqualTo(const malValue* rhs) const
+bool malSequence::doIsShallowEqualTo(const malValue* rhs,
+                                     EqualityQueue& pending) const
 {
     const malSequence* rhsSeq = static_cast<const malSequence*>(rhs);
     if (count() != rhsSeq->count()) {
         return false;
     }
 
-    for (malValueIter it0 = m_items->begin(),
-                      it1 = rhsSeq->begin(),
-                      end = m_items->end(); it0 != end; ++it0, ++it1) {
-
-        if (! (*it0)->isEqualTo((*it1).ptr())) {
-            return false;
-        }
+    // Queued in reverse, so that the items are compared front to back.
+    for (int i = count() - 1; i >= 0; i--) {
+        pending.push_back(std::make_pair((*m_items)[i].ptr(),
+                                         (*rhsSeq->m_items)[i].ptr()));
     }
     return true;
 }
 
-malValueVec* malSequence::evalItems(malEnvPtr env) const
+size_t malSequence::hash() const
+{
+    if (size_t hash = m_hash.get()) {
+        return hash;
+    }
+
+    // Lists and vectors with equal items are equal, so hash alike.
+    size_t hash = 1;
+    for (auto it = m_items->begin(), end = m_items->end(); it != end; ++it) {
+        hash = hash * 31 + (*it)->hash();
+    }
+    return m_hash.set(hash);
+}
+
+malValueVec* malSequence::evalItems(const malEnvPtr& env) const
 {
     malValueVec* items = new malValueVec;;
     items->reserve(count());
@@ -459,6 +632,16 @@ malValuePtr malSequence::rest() const
     return mal::list(start, end());
 }
 
+size_t malStringBase::hash() const
+{
+    if (size_t hash = m_hash.get()) {
+        return hash;
+    }
+    // Strings, keywords and symbols are never equal to each other.
+    return m_hash.set(std::hash<String>()(m_value) ^
+                      typeid(*this).hash_code());
+}
+
 String malString::escapedValue() const
 {
     return escape(value());
@@ -469,11 +652,287 @@ String malString::print(bool readably) const
     return readably ? escapedValue() : value();
 }
 
-malValuePtr malSymbol::eval(malEnvPtr env)
+malValuePtr malSymbol::eval(const malEnvPtr& env)
 {
     return env->get(value());
 }
 
+static malValuePtr applyTail(malValueIter argsBegin, malValueIter argsEnd)
+{
+    malValuePtr op = *argsBegin;
+    if (const malBuiltIn* builtin = DYNAMIC_CAST(malBuiltIn, op)) {
+        return builtin->applyTail(argsBegin + 1, argsEnd);
+    }
+    return APPLY(op, argsBegin + 1, argsEnd);
+}
+
+class malAtom::Guard {
+public:
+    Guard(const malAtom* atom) : m_atom(atom) {
+        if (m_atom->m_busy.test_and_set(std::memory_order_acquire)) {
+            m_atom->m_contention.fetch_add(1, std::memory_order_relaxed);
+            while (m_atom->m_busy.test_and_set(std::memory_order_acquire)) {
+                std::this_thread::yield();
+            }
+        }
+    }
+
+    ~Guard() { m_atom->m_busy.clear(std::memory_order_release); }
+
+private:
+    const malAtom* m_atom;
+};
+
+static void releaseValue(malValue* value)
+{
+    malValuePtr::adopt(value);
+}
+
+malAtom::malAtom(malValuePtr value)
+: m_value(value.ptr())
+, m_retries(0)
+, m_contention(0)
+{
+    m_busy.clear();
+    value->acquire();
+}
+
+malAtom::malAtom(const malAtom& that, malValuePtr meta)
+: malValue(meta)
+, m_retries(0)
+, m_contention(0)
+{
+    m_busy.clear();
+    malValuePtr value = that.deref();
+    value->acquire();
+    m_value.store(value.ptr());
+}
+
+malAtom::~malAtom()
+{
+    releaseValue(m_value.load());
+}
+
+malValuePtr malAtom::deref() const
+{
+    Guard guard(this);
+    return malValuePtr(m_value.load(std::memory_order_acquire));
+}
+
+malValuePtr malAtom::reset(malValuePtr value)
+{
+    value->acquire();
+    malValue* oldValue;
+    {
+        Guard guard(this);
+        oldValue = m_value.exchange(value.ptr(), std::memory_order_acq_rel);
+    }
+    releaseValue(oldValue);
+    return value;
+}
+
+bool malAtom::compareAndSet(const malValuePtr& expected,
+                            malValuePtr newValue)
+{
+    // Failing doesn't need the guard, as no reference changes hands.
+    malValue* oldValue = expected.ptr();
+    if (m_value.load(std::memory_order_acquire) != oldValue) {
+        return false;
+    }
+
+    newValue->acquire();
+    bool isSet;
+    {
+        Guard guard(this);
+        isSet = m_value.compare_exchange_strong(oldValue, newValue.ptr(),
+                                                std::memory_order_acq_rel);
+    }
+    releaseValue(isSet ? oldValue : newValue.ptr());
+    return isSet;
+}
+
+bool malPromise::complete(malValuePtr value, std::exception_ptr error)
+{
+    State& state = *m_state;
+    {
+        std::lock_guard<std::mutex> lock(state.mutex);
+        if (state.isDelivered) {
+            return false;
+        }
+        state.isDelivered = true;
+        state.value = value;
+        state.error = error;
+    }
+    state.delivered.notify_all();
+    return true;
+}
+
+bool malPromise::deliver(malValuePtr value)
+{
+    return complete(value, std::exception_ptr());
+}
+
+bool malPromise::deliverError(std::exception_ptr error)
+{
+    return complete(malValuePtr(), error);
+}
+
+// Without a timeout, the thread helps with queued work while it waits, as
+// that may well include whatever it is waiting for. With one, it doesn't,
+// as a task could run for any length of time past the deadline.
+malValuePtr malPromise::deref(int64_t timeoutMs) const
+{
+    using namespace std::chrono;
+    const steady_clock::time_point deadline =
+        steady_clock::now() + milliseconds(std::max<int64_t>(timeoutMs, 0));
+
+    State& state = *m_state;
+    std::unique_lock<std::mutex> lock(state.mutex);
+    while (!state.isDelivered) {
+        if (timeoutMs >= 0) {
+            if (!state.delivered.wait_until(lock, deadline, [&] {
+                    return state.isDelivered;
+                })) {
+                return malValuePtr();
+            }
+            break;
+        }
+
+        lock.unlock();
+        bool ranTask = ThreadPool::instance().runOne();
+        lock.lock();
+
+        if (!ranTask && !state.isDelivered) {
+            state.delivered.wait_for(lock, milliseconds(1));
+        }
+    }
+
+    if (state.error) {
+        std::rethrow_exception(state.error);
+    }
+    return state.value;
+}
+
+bool malPromise::isRealized() const
+{
+    std::lock_guard<std::mutex> lock(m_state->mutex);
+    return m_state->isDelivered;
+}
+
+String malPromise::print(bool readably) const
+{
+    return STRF("#promise(%p)", this);
+}
+
+malValuePtr malTailCall::resolve(malValuePtr value)
+{
+    // Chains of builtin tail calls are followed iteratively, but each
+    // continuation needs the fully resolved result of its call.
+    while (const malTailCall* tailCall = DYNAMIC_CAST(malTailCall, value)) {
+        malValuePtr current = value;
+        malValueVec call(tailCall->m_call);
+        if (tailCall->m_then.empty()) {
+            value = applyTail(call.begin(), call.end());
+            continue;
+        }
+        malValueVec then(tailCall->m_then);
+        then.push_back(resolve(applyTail(call.begin(), call.end())));
+        value = applyTail(then.begin(), then.end());
+    }
+    return value;
+}
+
+malValuePtr malTransducer::compose(malValueIter argsBegin,
+                                   malValueIter argsEnd)
+{
+    Stages stages;
+    for (auto it = argsBegin; it != argsEnd; ++it) {
+        const malTransducer* xf = VALUE_CAST(malTransducer, *it);
+        stages.insert(stages.end(), xf->m_stages.begin(), xf->m_stages.end());
+    }
+    return malValuePtr(new malTransducer(stages));
+}
+
+String malTransducer::print(bool readably) const
+{
+    static const char* names[] = { "map", "filter", "take", "partition" };
+
+    String s = "#transducer(";
+    for (auto it = m_stages.begin(), end = m_stages.end(); it != end; ++it) {
+        if (it != m_stages.begin()) {
+            s += " ";
+        }
+        s += names[it->kind];
+    }
+    return s + ")";
+}
+
+void malTransducer::reduce(malValueIter begin, malValueIter end,
+                           Reducer& reducer) const
+{
+    // Per-run state, so the same transducer can be used concurrently and
+    // re-entrantly.
+    const int stageCount = m_stages.size();
+    std::vector<int64_t> remaining(stageCount);
+    std::vector<malValueVec> buffers(stageCount);
+    for (int i = 0; i < stageCount; i++) {
+        remaining[i] = m_stages[i].count;
+    }
+
+    // Predicates and mapping functions are applied to this one-item vector,
+    // rather than allocating a fresh argument list for every call.
+    malValueVec arg(1);
+    bool isDone = false;
+    for (int i = 0; i < stageCount; i++) {
+        // Nothing gets past an empty take, so don't run the stages before
+        // it at all.
+        isDone = isDone || (m_stages[i].kind == TAKE && remaining[i] <= 0);
+    }
+
+    for (auto it = begin; it != end && !isDone; ++it) {
+        malValuePtr value = *it;
+        bool isDropped = false;
+        for (int i = 0; i < stageCount && !isDropped; i++) {
+            const Stage& stage = m_stages[i];
+            switch (stage.kind) {
+                case MAP:
+                    arg[0] = value;
+                    value = APPLY(stage.op, arg.begin(), arg.end());
+                    break;
+
+                case FILTER:
+                    arg[0] = value;
+                    isDropped = !APPLY(stage.op, arg.begin(), arg.end())
+                                    ->isTrue();
+                    break;
+
+                case TAKE:
+                    if (remaining[i] <= 0) {
+                        isDone = isDropped = true;
+                        break;
+                    }
+                    // Let this value through, but stop consuming the source
+                    // once the quota has been met.
+                    isDone = (--remaining[i] == 0);
+                    break;
+
+                case PARTITION:
+                    buffers[i].push_back(value);
+                    if ((int64_t)buffers[i].size() < stage.count) {
+                        isDropped = true;
+                        break;
+                    }
+                    value = mal::list(buffers[i].begin(), buffers[i].end());
+                    buffers[i].clear();
+                    break;
+            }
+        }
+        if (!isDropped) {
+            reducer.step(value);
+        }
+    }
+}
+
 malValuePtr malVector::conj(malValueIter argsBegin,
                             malValueIter argsEnd) const
 {
@@ -487,7 +946,7 @@ malValuePtr malVector::conj(malValueIter argsBegin,
     return mal::vector(items);
 }
 
-malValuePtr malVector::eval(malEnvPtr env)
+malValuePtr malVector::eval(const malEnvPtr& env)
 {
     return mal::vector(evalItems(env));
 }
@@ -1,10 +1,19 @@
 #ifndef INCLUDE_TYPES_H
 #define INCLUDE_TYPES_H
 
+#include "FlightRecorder.h"
 #include "MAL.h"
+#include "Stats.h"
 
+#include <atomic>
+#include <condition_variable>
+#include <deque>
 #include <exception>
+#include <list>
 #include <map>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
 
 class malEmptyInputException : public std::exception { };
 
@@ -28,18 +37,67 @@ public:
 
     bool isEqualTo(const malValue* rhs) const;
 
-    virtual malValuePtr eval(malEnvPtr env);
+    // A hash of the value's contents, consistent with isEqualTo. Values
+    // which are only equal to themselves hash by identity.
+    virtual size_t hash() const;
+
+    virtual malValuePtr eval(const malEnvPtr& env);
 
     virtual String print(bool readably) const = 0;
 
 protected:
+    typedef std::vector<std::pair<const malValue*, const malValue*>>
+        EqualityQueue;
+
     virtual bool doIsEqualTo(const malValue* rhs) const = 0;
 
+    // Containers override this to compare their sizes, and to queue up the
+    // pairs of items which must also be equal, so that deep structures are
+    // compared without recursion.
+    virtual bool doIsShallowEqualTo(const malValue* rhs,
+                                    EqualityQueue& pending) const {
+        return doIsEqualTo(rhs);
+    }
+
+    // Zero, unless the hash has already been computed and kept.
+    virtual size_t cachedHash() const { return 0; }
+
     malValuePtr m_meta;
 };
 
+// Kept by immutable values which are costly to hash. Values may be shared
+// between threads, but computing the hash twice does no harm.
+class malHashCache {
+public:
+    malHashCache() : m_hash(0) { }
+
+    size_t get() const { return m_hash.load(std::memory_order_relaxed); }
+
+    size_t set(size_t hash) const {
+        hash = (hash == 0) ? 1 : hash; // zero means not known yet
+        m_hash.store(hash, std::memory_order_relaxed);
+        return hash;
+    }
+
+private:
+    mutable std::atomic<size_t> m_hash;
+};
+
+// For containers keyed by mal values.
+struct malValueHash {
+    size_t operator()(const malValuePtr& value) const {
+        return value->hash();
+    }
+};
+
+struct malValueEqual {
+    bool operator()(const malValuePtr& lhs, const malValuePtr& rhs) const {
+        return lhs->isEqualTo(rhs.ptr());
+    }
+};
+
 template<class T>
-T* value_cast(malValuePtr obj, const char* typeName) {
+T* value_cast(const malValuePtr& obj, const char* typeName) {
     T* dest = dynamic_cast<T*>(obj.ptr());
     MAL_CHECK(dest != NULL, "%s is not a %s",
               obj->print(true).c_str(), typeName);
@@ -85,6 +143,8 @@ public:
 
     int64_t value() const { return m_value; }
 
+    virtual size_t hash() const { return std::hash<int64_t>()(m_value); }
+
     virtual bool doIsEqualTo(const malValue* rhs) const {
         return m_value == static_cast<const malInteger*>(rhs)->m_value;
     }
@@ -98,16 +158,24 @@ private:
 class malStringBase : public malValue {
 public:
     malStringBase(const String& token)
-        : m_value(token) { }
+        : m_value(token) {
+        FlightRecorder::noteAllocation("string", m_value.size());
+    }
     malStringBase(const malStringBase& that, malValuePtr meta)
         : malValue(meta), m_value(that.value()) { }
 
     virtual String print(bool readably) const { return m_value; }
 
-    String value() const { return m_value; }
+    const String& value() const { return m_value; }
+
+    virtual size_t hash() const;
+
+protected:
+    virtual size_t cachedHash() const { return m_hash.get(); }
 
 private:
     const String m_value;
+    malHashCache m_hash;
 };
 
 class malString : public malStringBase {
@@ -149,7 +217,7 @@ public:
     malSymbol(const malSymbol& that, malValuePtr meta)
         : malStringBase(that, meta) { }
 
-    virtual malValuePtr eval(malEnvPtr env);
+    virtual malValuePtr eval(const malEnvPtr& env);
 
     virtual bool doIsEqualTo(const malValue* rhs) const {
         return value() == static_cast<const malSymbol*>(rhs)->value();
@@ -167,15 +235,19 @@ public:
 
     virtual String print(bool readably) const;
 
-    malValueVec* evalItems(malEnvPtr env) const;
+    malValueVec* evalItems(const malEnvPtr& env) const;
     int count() const { return m_items->size(); }
     bool isEmpty() const { return m_items->empty(); }
-    malValuePtr item(int index) const { return (*m_items)[index]; }
+    const malValuePtr& item(int index) const { return (*m_items)[index]; }
 
     malValueIter begin() const { return m_items->begin(); }
     malValueIter end()   const { return m_items->end(); }
 
-    virtual bool doIsEqualTo(const malValue* rhs) const;
+    virtual bool doIsEqualTo(const malValue* rhs) const {
+        return isEqualTo(rhs);
+    }
+
+    virtual size_t hash() const;
 
     virtual malValuePtr conj(malValueIter argsBegin,
                               malValueIter argsEnd) const = 0;
@@ -183,8 +255,17 @@ public:
     malValuePtr first() const;
     virtual malValuePtr rest() const;
 
+protected:
+    virtual bool doIsShallowEqualTo(const malValue* rhs,
+                                    EqualityQueue& pending) const;
+
+    virtual size_t cachedHash() const { return m_hash.get(); }
+
 private:
+    void noteItems() const; // for the FlightRecorder
+
     malValueVec* const m_items;
+    malHashCache m_hash;
 };
 
 class malList : public malSequence {
@@ -196,7 +277,7 @@ public:
         : malSequence(that, meta) { }
 
     virtual String print(bool readably) const;
-    virtual malValuePtr eval(malEnvPtr env);
+    virtual malValuePtr eval(const malEnvPtr& env);
 
     virtual malValuePtr conj(malValueIter argsBegin,
                              malValueIter argsEnd) const;
@@ -212,7 +293,7 @@ public:
     malVector(const malVector& that, malValuePtr meta)
         : malSequence(that, meta) { }
 
-    virtual malValuePtr eval(malEnvPtr env);
+    virtual malValuePtr eval(const malEnvPtr& env);
     virtual String print(bool readably) const;
 
     virtual malValuePtr conj(malValueIter argsBegin,
@@ -232,7 +313,8 @@ public:
 
 class malHash : public malValue {
 public:
-    typedef std::map<String, malValuePtr> Map;
+    typedef std::unordered_map<malValuePtr, malValuePtr,
+                               malValueHash, malValueEqual> Map;
 
     malHash(malValueIter argsBegin, malValueIter argsEnd, bool isEvaluated);
     malHash(const malHash::Map& map);
@@ -242,20 +324,34 @@ public:
     malValuePtr assoc(malValueIter argsBegin, malValueIter argsEnd) const;
     malValuePtr dissoc(malValueIter argsBegin, malValueIter argsEnd) const;
     bool contains(malValuePtr key) const;
-    malValuePtr eval(malEnvPtr env);
+    malValuePtr eval(const malEnvPtr& env);
     malValuePtr get(malValuePtr key) const;
     malValuePtr keys() const;
     malValuePtr values() const;
 
+    const Map& map() const { return m_map; }
+    bool isEvaluated() const { return m_isEvaluated; }
+
+    virtual size_t hash() const;
+
     virtual String print(bool readably) const;
 
-    virtual bool doIsEqualTo(const malValue* rhs) const;
+    virtual bool doIsEqualTo(const malValue* rhs) const {
+        return isEqualTo(rhs);
+    }
 
     WITH_META(malHash);
 
+protected:
+    virtual bool doIsShallowEqualTo(const malValue* rhs,
+                                    EqualityQueue& pending) const;
+
+    virtual size_t cachedHash() const { return m_hash.get(); }
+
 private:
     const Map m_map;
     const bool m_isEvaluated;
+    malHashCache m_hash;
 };
 
 class malBuiltIn : public malApplicable {
@@ -265,14 +361,26 @@ public:
                                     malValueIter argsEnd);
 
     malBuiltIn(const String& name, ApplyFunc* handler)
-    : m_name(name), m_handler(handler) { }
+    : m_name(name), m_handler(handler)
+    , m_index(RuntimeStats::registerBuiltIn(name)) { }
 
     malBuiltIn(const malBuiltIn& that, malValuePtr meta)
-    : malApplicable(meta), m_name(that.m_name), m_handler(that.m_handler) { }
+    : malApplicable(meta), m_name(that.m_name), m_handler(that.m_handler)
+    , m_index(that.m_index) { }
 
     virtual malValuePtr apply(malValueIter argsBegin,
                               malValueIter argsEnd) const;
 
+    // As apply, but may return a malTailCall for the caller to complete.
+    malValuePtr applyTail(malValueIter argsBegin, malValueIter argsEnd) const {
+        FlightRecorder::noteBuiltIn(m_index);
+        if (RuntimeStats::countBuiltInCall(m_index)) {
+            RuntimeStats::BuiltInTimer timer(m_index);
+            return m_handler(m_name, argsBegin, argsEnd);
+        }
+        return m_handler(m_name, argsBegin, argsEnd);
+    }
+
     virtual String print(bool readably) const {
         return STRF("#builtin-function(%s)", m_name.c_str());
     }
@@ -288,6 +396,65 @@ public:
 private:
     const String m_name;
     ApplyFunc* m_handler;
+    const int m_index; // for RuntimeStats
+};
+
+// Wraps a function with a cache of its results, keyed by the structural
+// hash and equality of the arguments. A non-zero limit bounds the cache,
+// evicting the least recently used result.
+class malMemoized : public malApplicable {
+public:
+    malMemoized(malValuePtr op, size_t limit) : m_op(op), m_limit(limit) { }
+    malMemoized(const malMemoized& that, malValuePtr meta)
+        : malApplicable(meta), m_op(that.m_op), m_limit(that.m_limit) { }
+
+    virtual malValuePtr apply(malValueIter argsBegin,
+                              malValueIter argsEnd) const;
+
+    virtual String print(bool readably) const {
+        return "#memoized(" + m_op->print(readably) + ")";
+    }
+
+    malValuePtr op() const { return m_op; }
+    size_t limit() const { return m_limit; }
+
+    virtual bool doIsEqualTo(const malValue* rhs) const {
+        return this == rhs;
+    }
+
+    WITH_META(malMemoized);
+
+private:
+    friend class HeapDump;
+
+    struct Key {
+        Key(malValueIter argsBegin, malValueIter argsEnd);
+
+        malValueVec args;
+        size_t      hash;
+    };
+
+    struct KeyHash {
+        size_t operator()(const Key& key) const { return key.hash; }
+    };
+
+    struct KeyEqual {
+        bool operator()(const Key& lhs, const Key& rhs) const;
+    };
+
+    typedef std::list<const Key*> LruList; // most recently used first
+
+    struct Entry {
+        malValuePtr         value;
+        LruList::iterator   lru;
+    };
+
+    const malValuePtr   m_op;
+    const size_t        m_limit;
+
+    mutable std::mutex  m_mutex;
+    mutable std::unordered_map<Key, Entry, KeyHash, KeyEqual> m_cache;
+    mutable LruList     m_lru;
 };
 
 class malLambda : public malApplicable {
@@ -299,7 +466,9 @@ public:
     virtual malValuePtr apply(malValueIter argsBegin,
                               malValueIter argsEnd) const;
 
+    const StringVec& getBindings() const { return m_bindings; }
     malValuePtr getBody() const { return m_body; }
+    const malEnvPtr& getEnv() const { return m_env; }
     malEnvPtr makeEnv(malValueIter argsBegin, malValueIter argsEnd) const;
 
     virtual bool doIsEqualTo(const malValue* rhs) const {
@@ -321,35 +490,284 @@ private:
     const bool        m_isMacro;
 };
 
+// The value is swapped with compare-and-swap, so concurrent updates are
+// never lost. A short per-atom guard covers reading the pointer and taking
+// a reference to it, as the value may otherwise be freed in between.
 class malAtom : public malValue {
 public:
-    malAtom(malValuePtr value) : m_value(value) { }
-    malAtom(const malAtom& that, malValuePtr meta)
-        : malValue(meta), m_value(that.m_value) { }
+    malAtom(malValuePtr value);
+    malAtom(const malAtom& that, malValuePtr meta);
+    ~malAtom();
 
     virtual bool doIsEqualTo(const malValue* rhs) const {
-        return this->m_value->isEqualTo(rhs);
+        return deref()->isEqualTo(rhs);
     }
 
     virtual String print(bool readably) const {
-        return "(atom " + m_value->print(readably) + ")";
+        return "(atom " + deref()->print(readably) + ")";
     };
 
-    malValuePtr deref() const { return m_value; }
+    malValuePtr deref() const;
 
-    malValuePtr reset(malValuePtr value) { return m_value = value; }
+    malValuePtr reset(malValuePtr value);
+
+    // Sets the value to newValue if it is still expected, compared by
+    // identity.
+    bool compareAndSet(const malValuePtr& expected, malValuePtr newValue);
+
+    void noteRetry() { m_retries.fetch_add(1, std::memory_order_relaxed); }
+
+    int64_t retries() const {
+        return m_retries.load(std::memory_order_relaxed);
+    }
+    int64_t contention() const {
+        return m_contention.load(std::memory_order_relaxed);
+    }
 
     WITH_META(malAtom);
 
 private:
-    malValuePtr m_value;
+    class Guard;
+
+    mutable std::atomic<malValue*>  m_value; // holds a reference
+    mutable std::atomic_flag        m_busy;
+    std::atomic<int64_t>            m_retries;
+    mutable std::atomic<int64_t>    m_contention;
+};
+
+// A transactional reference, updated only inside dosync. It keeps a short
+// history of committed values, so transactions can read a consistent
+// snapshot while others commit. See STM.h.
+class malRef : public malValue {
+public:
+    malRef(malValuePtr value);
+    malRef(const malRef& that, malValuePtr meta);
+
+    virtual bool doIsEqualTo(const malValue* rhs) const {
+        return this == rhs;
+    }
+
+    virtual String print(bool readably) const {
+        return "(ref " + deref()->print(readably) + ")";
+    };
+
+    // The value as seen by the current transaction, if any.
+    malValuePtr deref() const;
+
+    WITH_META(malRef);
+
+private:
+    friend class HeapDump;
+    friend class Transaction;
+
+    struct Version {
+        malValuePtr value;
+        int64_t     point;
+    };
+
+    malValuePtr latest() const;
+
+    mutable std::recursive_mutex    m_mutex;
+    std::deque<Version>             m_history; // oldest first
+    size_t                          m_historyLimit;
+};
+
+// A channel between go blocks, or threads. Puts wait while the buffer is
+// full, and takes while it is empty; go blocks park rather than block
+// their thread. See Channel.h.
+class malChannel : public malValue {
+public:
+    // With no buffer, each put waits for a taker. A negative capacity
+    // makes the buffer unbounded.
+    malChannel(int capacity)
+        : m_capacity(capacity), m_isClosed(false) { }
+    malChannel(const malChannel& that, malValuePtr meta)
+        : malValue(meta), m_capacity(that.m_capacity), m_isClosed(false) { }
+
+    virtual bool doIsEqualTo(const malValue* rhs) const {
+        return this == rhs;
+    }
+
+    virtual String print(bool readably) const;
+
+    // Returns false if the channel was closed.
+    bool put(malValuePtr value);
+
+    // Returns nil once the channel is closed and drained.
+    malValuePtr take();
+
+    void close();
+
+    // The values buffered, and those waiting to be put.
+    malValueVec contents() const;
+
+    // Completes the first of the operations which can go ahead. Each is
+    // either a channel to take from, or a [channel value] vector to put
+    // to. Returns the value taken, or true for a put, and the channel.
+    static malValuePtr alts(malValueIter opsBegin, malValueIter opsEnd);
+
+    WITH_META(malChannel);
+
+    // A go block or thread waiting on channels. See Channel.cpp.
+    struct Waiter;
+    typedef std::shared_ptr<Waiter> WaiterPtr;
+
+private:
+
+    bool tryPut(malValuePtr value, bool& isPut);
+    bool tryTake(malValuePtr& value);
+    void forget(const WaiterPtr& waiter);
+
+    const int                                       m_capacity;
+    bool                                            m_isClosed;
+    std::deque<malValuePtr>                         m_buffer;
+    std::deque<WaiterPtr>                           m_takers;
+    std::deque<std::pair<WaiterPtr, malValuePtr>>   m_putters;
+};
+
+// A value which is delivered once, possibly by another thread. Readers
+// block until it arrives, running queued pool tasks while they wait.
+class malPromise : public malValue {
+public:
+    malPromise() : m_state(std::make_shared<State>()) { }
+    // The copy is delivered along with the original.
+    malPromise(const malPromise& that, malValuePtr meta)
+        : malValue(meta), m_state(that.m_state) { }
+
+    // Returns false if the promise had already been delivered.
+    bool deliver(malValuePtr value);
+    bool deliverError(std::exception_ptr error);
+
+    // A negative timeout waits forever. On timeout, returns NULL.
+    malValuePtr deref(int64_t timeoutMs = -1) const;
+
+    bool isRealized() const;
+
+    virtual String print(bool readably) const;
+
+    virtual bool doIsEqualTo(const malValue* rhs) const {
+        return this == rhs;
+    }
+
+    WITH_META(malPromise);
+
+private:
+    friend class HeapDump;
+
+    bool complete(malValuePtr value, std::exception_ptr error);
+
+    // Shared with copies made by with-meta.
+    struct State {
+        State() : isDelivered(false) { }
+
+        std::mutex              mutex;
+        std::condition_variable delivered;
+        bool                    isDelivered;
+        malValuePtr             value;
+        std::exception_ptr      error;
+    };
+
+    const std::shared_ptr<State> m_state;
+};
+
+// A promise which is delivered with the result of calling op on the
+// thread pool.
+class malFuture : public malPromise {
+public:
+    malFuture() { }
+    malFuture(const malFuture& that, malValuePtr meta)
+        : malPromise(that, meta) { }
+
+    static void start(malValuePtr self, malValuePtr op);
+
+    virtual String print(bool readably) const;
+
+    WITH_META(malFuture);
+};
+
+// Returned by builtins which would otherwise call back into mal in tail
+// position. The evaluator applies the call itself, so that code which
+// recurses through apply or swap! does not grow the native stack.
+// If there is a continuation, it is applied to its own arguments followed
+// by the result of the call. These never escape to mal code.
+class malTailCall : public malValue {
+public:
+    malTailCall(malValueVec call, malValueVec then)
+        : m_call(std::move(call)), m_then(std::move(then)) { }
+    malTailCall(const malTailCall& that, malValuePtr meta)
+        : malValue(meta), m_call(that.m_call), m_then(that.m_then) { }
+
+    // Completes any tail calls in value, recursing natively if need be.
+    static malValuePtr resolve(malValuePtr value);
+
+    // The function, followed by its arguments.
+    const malValueVec& call() const { return m_call; }
+    const malValueVec& then() const { return m_then; }
+
+    virtual String print(bool readably) const { return "#tail-call"; }
+
+    virtual bool doIsEqualTo(const malValue* rhs) const {
+        return this == rhs;
+    }
+
+    WITH_META(malTailCall);
+
+private:
+    const malValueVec m_call;
+    const malValueVec m_then;
+};
+
+class malTransducer : public malValue {
+public:
+    enum Kind { MAP, FILTER, TAKE, PARTITION };
+
+    struct Stage {
+        Kind        kind;
+        malValuePtr op;     // MAP, FILTER
+        int64_t     count;  // TAKE, PARTITION
+    };
+    typedef std::vector<Stage> Stages;
+
+    // Receives each value that comes out of the end of the pipeline.
+    class Reducer {
+    public:
+        virtual ~Reducer() { }
+        virtual void step(malValuePtr value) = 0;
+    };
+
+    malTransducer(const Stages& stages) : m_stages(stages) { }
+    malTransducer(const malTransducer& that, malValuePtr meta)
+        : malValue(meta), m_stages(that.m_stages) { }
+
+    // Appends the stages of each transducer, so data flows through them
+    // left to right, as with Clojure's comp.
+    static malValuePtr compose(malValueIter argsBegin, malValueIter argsEnd);
+
+    // Runs every item in [begin, end) through all of the stages in a single
+    // pass, without building any intermediate collections.
+    void reduce(malValueIter begin, malValueIter end, Reducer& reducer) const;
+
+    const Stages& stages() const { return m_stages; }
+
+    virtual String print(bool readably) const;
+
+    virtual bool doIsEqualTo(const malValue* rhs) const {
+        return this == rhs;
+    }
+
+    WITH_META(malTransducer);
+
+private:
+    const Stages m_stages;
 };
 
 namespace mal {
     malValuePtr atom(malValuePtr value);
     malValuePtr boolean(bool value);
     malValuePtr builtin(const String& name, malBuiltIn::ApplyFunc handler);
-    malValuePtr falseValue();
+    malValuePtr channel(int capacity);
+    const malValuePtr& falseValue();
+    malValuePtr future(malValuePtr op);
     malValuePtr hash(malValueIter argsBegin, malValueIter argsEnd,
                      bool isEvaluated);
     malValuePtr hash(const malHash::Map& map);
@@ -363,10 +781,17 @@ namespace mal {
     malValuePtr list(malValuePtr a, malValuePtr b);
     malValuePtr list(malValuePtr a, malValuePtr b, malValuePtr c);
     malValuePtr macro(const malLambda& lambda);
-    malValuePtr nilValue();
+    malValuePtr memoize(malValuePtr op, size_t limit);
+    const malValuePtr& nilValue();
+    malValuePtr promise();
+    malValuePtr ref(malValuePtr value);
     malValuePtr string(const String& token);
     malValuePtr symbol(const String& token);
-    malValuePtr trueValue();
+    malValuePtr tailCall(malValueVec call, malValueVec then = malValueVec());
+    malValuePtr transducer(malTransducer::Kind kind, malValuePtr op);
+    malValuePtr transducer(malTransducer::Kind kind, int64_t count);
+    malValuePtr transducer(const malTransducer::Stages& stages);
+    const malValuePtr& trueValue();
     malValuePtr vector(malValueVec* items);
     malValuePtr vector(malValueIter begin, malValueIter end);
 };
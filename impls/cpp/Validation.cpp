@@ -1,4 +1,13 @@
 #include "Validation.h"
+#include "FlightRecorder.h"
+#include "Stats.h"
+
+const String& noteError(const String& message)
+{
+    RuntimeStats::count(RuntimeStats::ExceptionsThrown);
+    FlightRecorder::noteError(message);
+    return message;
+}
 
 int checkArgsIs(const char* name, int expected, int got)
 {
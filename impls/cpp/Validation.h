@@ -4,10 +4,13 @@
 #include "String.h"
 
 #define MAL_CHECK(condition, ...)  \
-    if (!(condition)) { throw STRF(__VA_ARGS__); } else { }
+    if (!(condition)) { throw noteError(STRF(__VA_ARGS__)); } else { }
 
 #define MAL_FAIL(...) MAL_CHECK(false, __VA_ARGS__)
 
+// Counts and records the error, and returns its message to be thrown.
+extern const String& noteError(const String& message);
+
 extern int checkArgsIs(const char* name, int expected, int got);
 extern int checkArgsBetween(const char* name, int min, int max, int got);
 extern int checkArgsAtLeast(const char* name, int min, int got);
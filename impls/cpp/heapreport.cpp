@@ -0,0 +1,324 @@
+#include "String.h"
+
+#include <algorithm>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <sstream>
+
+// Reads a heap dump written by heap-dump, and reports the objects which
+// retain the most memory, with a path to each from a root, and the
+// reference cycles which are alive but can't be reached. See HeapDump.h.
+//
+//     heapreport dump [count]
+//
+// It only needs String.o, so that it can be built without the interpreter.
+
+#define CHECK(condition, ...) \
+    if (!(condition)) { throw STRF(__VA_ARGS__); } else { }
+
+struct Object {
+    String              type;
+    size_t              size;
+    int                 refCount;
+    int                 parent; // -1 for roots, -2 if not reachable
+    std::vector<int>    edges;
+};
+
+static void readDump(const char* path, std::vector<Object>& objects,
+                     std::vector<int>& roots, std::map<int, String>& names)
+{
+    std::ifstream file(path);
+    CHECK(!file.fail(), "Cannot open %s", path);
+    String line;
+    CHECK(std::getline(file, line) && line == "mal-heap-dump 1",
+              "%s isn't a heap dump", path);
+
+    while (std::getline(file, line)) {
+        std::istringstream fields(line);
+        if (line.compare(0, 5, "root ") == 0) {
+            String tag, name;
+            int id;
+            fields >> tag >> id >> name;
+            roots.push_back(id);
+            names.insert(std::make_pair(id, name));
+            continue;
+        }
+        Object object;
+        String id, parent;
+        fields >> id >> object.type >> object.size >> object.refCount
+               >> parent;
+        CHECK(!fields.fail() && std::stoul(id) == objects.size(),
+                  "Corrupt heap dump: %s", line.c_str());
+        object.parent = parent == "-" ? -1 :
+                        parent == "?" ? -2 : std::stoi(parent);
+        int edge;
+        while (fields >> edge) {
+            object.edges.push_back(edge);
+        }
+        objects.push_back(object);
+    }
+    for (auto& object : objects) {
+        for (int edge : object.edges) {
+            CHECK(edge >= 0 && edge < (int)objects.size(),
+                      "Corrupt heap dump: no object %d", edge);
+        }
+    }
+}
+
+// The immediate dominator of each object reachable from the roots: the
+// nearest object which every path from a root to it passes through. The
+// roots are all dominated by a notional object, numbered objects.size().
+// Uses the iterative algorithm of Cooper, Harvey and Kennedy. Returns the
+// reachable objects in postorder, with -1 for the others.
+static std::vector<int> dominators(const std::vector<Object>& objects,
+                                   const std::vector<int>& roots,
+                                   std::vector<int>& postorder)
+{
+    const int top = objects.size();
+    auto successors = [&](int id) -> const std::vector<int>& {
+        return id == top ? roots : objects[id].edges;
+    };
+
+    std::vector<int> order(top + 1, -1); // position in postorder
+    std::vector<std::vector<int>> predecessors(top + 1);
+    std::vector<std::pair<int, size_t>> pending { { top, 0 } };
+    std::vector<bool> isSeen(top + 1, false);
+    isSeen[top] = true;
+    while (!pending.empty()) {
+        int id = pending.back().first;
+        size_t next = pending.back().second++;
+        const std::vector<int>& edges = successors(id);
+        if (next == edges.size()) {
+            order[id] = postorder.size();
+            postorder.push_back(id);
+            pending.pop_back();
+            continue;
+        }
+        int to = edges[next];
+        predecessors[to].push_back(id);
+        if (!isSeen[to]) {
+            isSeen[to] = true;
+            pending.push_back(std::make_pair(to, 0));
+        }
+    }
+
+    std::vector<int> idom(top + 1, -1);
+    idom[top] = top;
+    auto intersect = [&](int a, int b) {
+        while (a != b) {
+            while (order[a] < order[b]) {
+                a = idom[a];
+            }
+            while (order[b] < order[a]) {
+                b = idom[b];
+            }
+        }
+        return a;
+    };
+    for (bool isChanged = true; isChanged; ) {
+        isChanged = false;
+        for (auto it = postorder.rbegin() + 1; it != postorder.rend(); ++it) {
+            int newIdom = -1;
+            for (int from : predecessors[*it]) {
+                if (idom[from] != -1) {
+                    newIdom = newIdom == -1 ? from : intersect(from, newIdom);
+                }
+            }
+            if (idom[*it] != newIdom) {
+                idom[*it] = newIdom;
+                isChanged = true;
+            }
+        }
+    }
+    postorder.pop_back(); // the notional root
+    return idom;
+}
+
+// The root an object was first reached from, and the types on the way,
+// with the middle left out of long paths.
+static String path(const std::vector<Object>& objects,
+                   const std::map<int, String>& names, int id)
+{
+    StringVec types; // innermost first
+    for (; objects[id].parent >= 0; id = objects[id].parent) {
+        types.push_back(objects[id].type);
+    }
+    String path = names.find(id)->second;
+    const size_t maxShown = 6;
+    const size_t count = types.size();
+    for (size_t i = 0; i < count; i++) {
+        if (count > maxShown && i == maxShown / 2) {
+            path += " > ...";
+            i = count - maxShown / 2 - 1;
+            continue;
+        }
+        path += " > " + types[count - 1 - i];
+    }
+    return path;
+}
+
+// Strongly connected components of the objects which can't be reached,
+// found with Tarjan's algorithm. Those of more than one object, or which
+// refer to themselves, are cycles.
+static std::vector<std::vector<int>> cycles(const std::vector<Object>& objects)
+{
+    const int count = objects.size();
+    std::vector<int> index(count, -1), lowLink(count, 0);
+    std::vector<bool> isOnStack(count, false);
+    std::vector<int> stack;
+    std::vector<std::vector<int>> cycles;
+    int nextIndex = 0;
+
+    for (int start = 0; start < count; start++) {
+        if (objects[start].parent != -2 || index[start] != -1) {
+            continue;
+        }
+        std::vector<std::pair<int, size_t>> pending { { start, 0 } };
+        index[start] = lowLink[start] = nextIndex++;
+        stack.push_back(start);
+        isOnStack[start] = true;
+        while (!pending.empty()) {
+            int id = pending.back().first;
+            size_t next = pending.back().second++;
+            const std::vector<int>& edges = objects[id].edges;
+            if (next < edges.size()) {
+                int to = edges[next];
+                if (objects[to].parent != -2) {
+                    continue;
+                }
+                if (index[to] == -1) {
+                    index[to] = lowLink[to] = nextIndex++;
+                    stack.push_back(to);
+                    isOnStack[to] = true;
+                    pending.push_back(std::make_pair(to, 0));
+                }
+                else if (isOnStack[to]) {
+                    lowLink[id] = std::min(lowLink[id], index[to]);
+                }
+                continue;
+            }
+
+            pending.pop_back();
+            if (!pending.empty()) {
+                int from = pending.back().first;
+                lowLink[from] = std::min(lowLink[from], lowLink[id]);
+            }
+            if (lowLink[id] != index[id]) {
+                continue;
+            }
+            std::vector<int> component;
+            int member;
+            do {
+                member = stack.back();
+                stack.pop_back();
+                isOnStack[member] = false;
+                component.push_back(member);
+            } while (member != id);
+            const std::vector<int>& own = objects[id].edges;
+            if (component.size() > 1 ||
+                    std::find(own.begin(), own.end(), id) != own.end()) {
+                cycles.push_back(component);
+            }
+        }
+    }
+    return cycles;
+}
+
+static String typeCounts(const std::vector<Object>& objects,
+                         const std::vector<int>& ids)
+{
+    std::map<String, int> counts;
+    for (int id : ids) {
+        counts[objects[id].type]++;
+    }
+    String text;
+    for (auto& it : counts) {
+        text += (text.empty() ? "" : ", ") + it.first;
+        if (it.second > 1) {
+            text += STRF(" x%d", it.second);
+        }
+    }
+    return text;
+}
+
+int main(int argc, char* argv[])
+{
+    if (argc < 2 || argc > 3) {
+        std::cerr << "Usage: heapreport dump [count]\n";
+        return 1;
+    }
+    size_t maxShown = argc == 3 ? atoi(argv[2]) : 20;
+
+    std::vector<Object> objects;
+    std::vector<int> roots;
+    std::map<int, String> names;
+    try {
+        readDump(argv[1], objects, roots, names);
+    }
+    catch (String& s) {
+        std::cerr << "heapreport: " << s << "\n";
+        return 1;
+    }
+
+    std::vector<int> postorder;
+    std::vector<int> idom = dominators(objects, roots, postorder);
+    std::vector<size_t> retained(objects.size() + 1, 0);
+    std::vector<size_t> retainedCount(objects.size() + 1, 0);
+    for (int id : postorder) {
+        retained[id] += objects[id].size;
+        retainedCount[id]++;
+        retained[idom[id]] += retained[id];
+        retainedCount[idom[id]] += retainedCount[id];
+    }
+
+    size_t totalBytes = 0, unreachableCount = 0, unreachableBytes = 0;
+    for (auto& object : objects) {
+        totalBytes += object.size;
+        if (object.parent == -2) {
+            unreachableCount++;
+            unreachableBytes += object.size;
+        }
+    }
+    std::cout << STRF("%zu objects, %zu bytes, from %zu roots\n",
+                      objects.size(), totalBytes, names.size());
+    std::cout << STRF("%zu objects, %zu bytes, can't be reached\n\n",
+                      unreachableCount, unreachableBytes);
+
+    std::vector<int> largest = postorder;
+    std::stable_sort(largest.begin(), largest.end(), [&](int a, int b) {
+        return retained[a] > retained[b];
+    });
+    largest.resize(std::min(largest.size(), maxShown));
+    std::cout << "Largest retainers:\n"
+              << STRF("%10s %8s  %-16s %s\n",
+                      "retained", "objects", "type", "path");
+    for (int id : largest) {
+        std::cout << STRF("%10zu %8zu  %-16s %s\n", retained[id],
+                          retainedCount[id], objects[id].type.c_str(),
+                          path(objects, names, id).c_str());
+    }
+
+    std::vector<std::vector<int>> found = cycles(objects);
+    std::vector<std::pair<size_t, size_t>> cycleBytes; // bytes, index
+    for (size_t i = 0; i < found.size(); i++) {
+        size_t bytes = 0;
+        for (int id : found[i]) {
+            bytes += objects[id].size;
+        }
+        cycleBytes.push_back(std::make_pair(bytes, i));
+    }
+    std::stable_sort(cycleBytes.begin(), cycleBytes.end(),
+                     std::greater<std::pair<size_t, size_t>>());
+    std::cout << STRF("\n%zu unreachable cycles:\n", found.size());
+    if (found.empty()) {
+        return 0;
+    }
+    std::cout << STRF("%10s %8s  %s\n", "bytes", "objects", "types");
+    for (size_t i = 0; i < cycleBytes.size() && i < maxShown; i++) {
+        const std::vector<int>& cycle = found[cycleBytes[i].second];
+        std::cout << STRF("%10zu %8zu  %s\n", cycleBytes[i].first,
+                          cycle.size(), typeCounts(objects, cycle).c_str());
+    }
+    return 0;
+}
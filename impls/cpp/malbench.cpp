@@ -0,0 +1,249 @@
+#include "MAL.h"
+
+#include "Environment.h"
+#include "Serialize.h"
+#include "Stats.h"
+#include "Types.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+
+#include <sys/resource.h>
+#include <unistd.h>
+
+// Runs mal workloads, such as tests/perf*.mal, inside the one process, and
+// reports how long each took, and what it cost, as JSON. Each trial runs
+// the workload in a global environment of its own, made as stepA makes
+// one, so it pays for loading whatever the workload loads, but not for
+// starting a process or installing the core and prelude. Warmups are run
+// first, and not reported.
+//
+//     malbench [-warmup n] [-trials n] workload.mal...
+//
+// A workload is run from its own directory, so that the paths it loads
+// are found, and what it prints is kept, rather than written out, the last
+// trial's being reported.
+
+// Prelude.cpp is generated from prelude.mal by mkprelude.
+extern const char preludeData[];
+extern const size_t preludeSize;
+
+struct Trial {
+    int64_t     wallNanos;
+    int64_t     cpuNanos;       // all threads, user and system
+    int64_t     allocations;    // of values and environments
+    int64_t     allocatedBytes;
+    int64_t     rssBytes;       // resident once the trial is over
+};
+
+static int64_t cpuNanos()
+{
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return (usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * 1000000000LL +
+           (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) * 1000LL;
+}
+
+static int64_t maxRssBytes()
+{
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_maxrss * 1024LL; // in KB on Linux
+}
+
+// Linux only; 0 elsewhere.
+static int64_t rssBytes()
+{
+    std::ifstream statm("/proc/self/statm");
+    int64_t size = 0, resident = 0;
+    if (!(statm >> size >> resident)) {
+        return 0;
+    }
+    return resident * sysconf(_SC_PAGESIZE);
+}
+
+static malEnvPtr newGlobals()
+{
+    malEnvPtr env(new malEnv);
+    installCore(env);
+    EVAL(deserialize(preludeData, preludeSize, env), env);
+    env->set("*ARGV*", mal::list(new malValueVec));
+    return env;
+}
+
+// Runs the file, which is in the current directory, capturing its output.
+static Trial runTrial(const String& file, String& output)
+{
+    malEnvPtr env = newGlobals();
+    std::ostringstream captured;
+    std::streambuf* stdoutBuf = std::cout.rdbuf(captured.rdbuf());
+
+    uint64_t objectsBefore, bytesBefore, objectsAfter, bytesAfter;
+    RuntimeStats::allocations(objectsBefore, bytesBefore);
+    const int64_t cpuBefore = cpuNanos();
+    auto start = std::chrono::steady_clock::now();
+    try {
+        rep(STRF("(load-file %s)", escape(file).c_str()), env);
+    }
+    catch (...) {
+        std::cout.rdbuf(stdoutBuf);
+        throw;
+    }
+    Trial trial;
+    trial.wallNanos = std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now() - start).count();
+    trial.cpuNanos = cpuNanos() - cpuBefore;
+    RuntimeStats::allocations(objectsAfter, bytesAfter);
+    std::cout.rdbuf(stdoutBuf);
+
+    trial.allocations = objectsAfter - objectsBefore;
+    trial.allocatedBytes = bytesAfter - bytesBefore;
+    trial.rssBytes = rssBytes();
+    output = captured.str();
+    return trial;
+}
+
+// The distribution of one measure over the trials.
+static String distribution(const std::vector<Trial>& trials,
+                           int64_t Trial::*measure)
+{
+    std::vector<int64_t> values;
+    for (auto& trial : trials) {
+        values.push_back(trial.*measure);
+    }
+    String samples;
+    for (int64_t value : values) {
+        samples += STRF("%s%lld", samples.empty() ? "" : ", ",
+                        (long long)value);
+    }
+    std::sort(values.begin(), values.end());
+
+    const size_t count = values.size();
+    double sum = 0;
+    for (int64_t value : values) {
+        sum += value;
+    }
+    double mean = sum / count;
+    double squares = 0;
+    for (int64_t value : values) {
+        squares += (value - mean) * (value - mean);
+    }
+    return STRF("{ \"min\": %lld, \"median\": %lld, \"mean\": %lld, "
+                "\"max\": %lld, \"stddev\": %lld, \"samples\": [%s] }",
+                (long long)values.front(),
+                (long long)values[(count - 1) / 2], llround(mean),
+                (long long)values.back(), llround(sqrt(squares / count)),
+                samples.c_str());
+}
+
+// Splits path into the directory to run the workload from, and its name.
+static void splitPath(const String& path, String& directory, String& file)
+{
+    size_t slash = path.rfind('/');
+    directory = slash == String::npos ? "." : path.substr(0, slash + 1);
+    file = slash == String::npos ? path : path.substr(slash + 1);
+}
+
+// Sets isFailed if the workload throws an error.
+static String runWorkload(const String& path, int warmups, int trialCount,
+                          bool& isFailed)
+{
+    String directory, file;
+    splitPath(path, directory, file);
+    char cwd[4096];
+    MAL_CHECK(getcwd(cwd, sizeof(cwd)) != NULL, "Cannot find the directory");
+    MAL_CHECK(chdir(directory.c_str()) == 0, "Cannot change to %s",
+              directory.c_str());
+
+    std::vector<Trial> trials;
+    String output, error;
+    try {
+        for (int i = 0; i < warmups; i++) {
+            runTrial(file, output);
+        }
+        for (int i = 0; i < trialCount; i++) {
+            trials.push_back(runTrial(file, output));
+        }
+    }
+    catch (malValuePtr& mv) {
+        error = mv->print(true);
+    }
+    catch (String& s) {
+        error = s;
+    }
+    if (chdir(cwd) != 0) {
+        error = STRF("Cannot change back to %s", cwd);
+    }
+
+    String json = STRF("    {\n      \"name\": %s,\n      \"path\": %s,\n",
+                       jsonEscape(file).c_str(), jsonEscape(path).c_str());
+    if (!error.empty()) {
+        isFailed = true;
+        return json + STRF("      \"error\": %s\n    }",
+                           jsonEscape(error).c_str());
+    }
+    json += STRF("      \"wall-ns\": %s,\n",
+                 distribution(trials, &Trial::wallNanos).c_str());
+    json += STRF("      \"cpu-ns\": %s,\n",
+                 distribution(trials, &Trial::cpuNanos).c_str());
+    json += STRF("      \"allocations\": %s,\n",
+                 distribution(trials, &Trial::allocations).c_str());
+    json += STRF("      \"allocated-bytes\": %s,\n",
+                 distribution(trials, &Trial::allocatedBytes).c_str());
+    json += STRF("      \"rss-bytes\": %s,\n",
+                 distribution(trials, &Trial::rssBytes).c_str());
+    // The peak is of the whole run so far. getrusage can lag /proc.
+    int64_t peak = maxRssBytes();
+    for (auto& trial : trials) {
+        peak = std::max(peak, trial.rssBytes);
+    }
+    json += STRF("      \"max-rss-bytes\": %lld,\n", (long long)peak);
+    return json + STRF("      \"output\": %s\n    }",
+                       jsonEscape(output).c_str());
+}
+
+int main(int argc, char* argv[])
+{
+    int warmups = 1, trialCount = 5;
+    int argi = 1;
+    for (; argi + 1 < argc; argi += 2) {
+        if (strcmp(argv[argi], "-warmup") == 0) {
+            warmups = atoi(argv[argi + 1]);
+        }
+        else if (strcmp(argv[argi], "-trials") == 0) {
+            trialCount = atoi(argv[argi + 1]);
+        }
+        else {
+            break;
+        }
+    }
+    if (argi == argc || trialCount < 1 || argv[argi][0] == '-') {
+        std::cerr << "Usage: malbench [-warmup n] [-trials n] "
+                     "workload.mal...\n";
+        return 1;
+    }
+
+    bool isFailed = false;
+    std::cout << STRF("{\n  \"warmup\": %d,\n  \"trials\": %d,\n"
+                      "  \"workloads\": [\n", warmups, trialCount);
+    for (int i = argi; i < argc; i++) {
+        String json;
+        try {
+            json = runWorkload(argv[i], warmups, trialCount, isFailed);
+        }
+        catch (String& s) {
+            isFailed = true;
+            json = STRF("    {\n      \"path\": %s,\n      \"error\": %s\n"
+                        "    }", jsonEscape(argv[i]).c_str(),
+                        jsonEscape(s).c_str());
+        }
+        std::cout << json << (i + 1 < argc ? ",\n" : "\n") << std::flush;
+    }
+    std::cout << "  ]\n}\n";
+    return isFailed ? 1 : 0;
+}
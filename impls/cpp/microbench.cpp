@@ -0,0 +1,345 @@
+#include "MAL.h"
+
+#include "Environment.h"
+#include "Stats.h"
+#include "Types.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <functional>
+#include <iostream>
+
+// Microbenchmarks of the building blocks of the interpreter, run by
+// make bench. Each result is written on a line of its own in the format of
+// Go's benchmarks, which benchstat reads, so that runs before and after a
+// change can be compared:
+//
+//     BenchmarkEnvGet/depth=4  20000000  61.2 ns/op  0 B/op  0 allocs/op
+//
+//     microbench [-count n] [-time ms] [substring]
+//
+// -count runs each benchmark n times, for benchstat to judge the noise, and
+// -time is how long each run lasts (500ms by default). Only benchmarks
+// whose names contain substring are run.
+//
+// It links in stepA's evaluator, so that lambdas can be applied.
+
+class Benchmark {
+public:
+    Benchmark(int64_t iterations)
+    : m_iterations(iterations), m_bytes(0), m_nanos(0)
+    , m_objects(0), m_allocatedBytes(0) { }
+
+    int64_t iterations() const { return m_iterations; }
+
+    // Only the time between start and stop is measured, so that the
+    // set-up done beforehand isn't.
+    void start() {
+        RuntimeStats::threadAllocations(m_objects, m_allocatedBytes);
+        m_start = std::chrono::steady_clock::now();
+    }
+    void stop() {
+        m_nanos = std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now() - m_start).count();
+        uint64_t objects, bytes;
+        RuntimeStats::threadAllocations(objects, bytes);
+        m_objects = objects - m_objects;
+        m_allocatedBytes = bytes - m_allocatedBytes;
+    }
+
+    // The bytes processed by each iteration, for a throughput in MB/s.
+    void setBytes(int64_t bytes) { m_bytes = bytes; }
+
+    int64_t nanos() const { return m_nanos; }
+    String result(const String& name) const;
+
+private:
+    int64_t     m_iterations;
+    int64_t     m_bytes;
+    int64_t     m_nanos;
+    uint64_t    m_objects;
+    uint64_t    m_allocatedBytes;
+    std::chrono::steady_clock::time_point m_start;
+};
+
+String Benchmark::result(const String& name) const
+{
+    const double n = (double)m_iterations;
+    String text = STRF("Benchmark%s\t%lld\t%.2f ns/op", name.c_str(),
+                       (long long)m_iterations, m_nanos / n);
+    if (m_bytes > 0 && m_nanos > 0) {
+        text += STRF("\t%.2f MB/s", m_bytes * n * 1000 / m_nanos);
+    }
+    // Allocations are counted, and sized, as RefCounted objects only.
+    text += STRF("\t%.0f B/op\t%.0f allocs/op", m_allocatedBytes / n,
+                 m_objects / n);
+    return text;
+}
+
+typedef std::function<void (Benchmark&)> BenchFunc;
+
+struct BenchCase {
+    String      name;
+    BenchFunc   run;
+};
+
+// Assigned the results of the code benchmarked, so that it isn't optimized
+// away.
+static malValuePtr s_sink;
+static String s_printed;
+
+static malEnvPtr s_env(new malEnv);
+
+static String largeProgram()
+{
+    String text = "(do";
+    for (int i = 0; i < 200; i++) {
+        text += STRF("\n  (def! f%d (fn* [a b] {:name \"f%d\" :n %d "
+                     ":items [a b 1 2 3] :quoted '(x y \"z\\n\")}))",
+                     i, i, i * 7919);
+    }
+    return text + ")";
+}
+
+static malValuePtr integers(int count, bool isVector)
+{
+    malValueVec* items = new malValueVec;
+    for (int i = 0; i < count; i++) {
+        items->push_back(mal::integer(i));
+    }
+    return isVector ? mal::vector(items) : mal::list(items);
+}
+
+static malValuePtr hashOf(int count)
+{
+    malValueVec items;
+    for (int i = 0; i < count; i++) {
+        items.push_back(mal::keyword(STRF(":k%d", i)));
+        items.push_back(mal::integer(i));
+    }
+    return mal::hash(items.begin(), items.end(), true);
+}
+
+static void addReaderBenchmarks(std::vector<BenchCase>& cases)
+{
+    const String small = "(+ 1 (* 2 3))";
+    cases.push_back({ "ReadStr/small", [=](Benchmark& b) {
+        b.setBytes(small.size());
+        b.start();
+        for (int64_t i = 0; i < b.iterations(); i++) {
+            s_sink = readStr(small);
+        }
+        b.stop();
+    }});
+    const String large = largeProgram();
+    cases.push_back({ "ReadStr/large", [=](Benchmark& b) {
+        b.setBytes(large.size());
+        b.start();
+        for (int64_t i = 0; i < b.iterations(); i++) {
+            s_sink = readStr(large);
+        }
+        b.stop();
+    }});
+    cases.push_back({ "Print", [=](Benchmark& b) {
+        malValuePtr form = readStr(large);
+        b.setBytes(large.size());
+        b.start();
+        for (int64_t i = 0; i < b.iterations(); i++) {
+            s_printed = form->print(true);
+        }
+        b.stop();
+    }});
+}
+
+// Symbols are looked up from the innermost of a chain of environments, each
+// binding a few names, and found in the outermost.
+static void addEnvBenchmarks(std::vector<BenchCase>& cases)
+{
+    for (int depth : { 0, 1, 4, 16 }) {
+        cases.push_back({ STRF("EnvGet/depth=%d", depth),
+                          [=](Benchmark& b) {
+            malEnvPtr env(new malEnv);
+            env->set("target", mal::integer(1));
+            for (int i = 0; i < depth; i++) {
+                env = malEnvPtr(new malEnv(env));
+                for (const char* name : { "a", "b", "c" }) {
+                    env->set(name, mal::integer(i));
+                }
+            }
+            const String symbol = "target";
+            b.start();
+            for (int64_t i = 0; i < b.iterations(); i++) {
+                s_sink = env->get(symbol);
+            }
+            b.stop();
+        }});
+    }
+}
+
+static void addCollectionBenchmarks(std::vector<BenchCase>& cases)
+{
+    for (int size : { 8, 1024 }) {
+        cases.push_back({ STRF("HashAssoc/size=%d", size),
+                          [=](Benchmark& b) {
+            malValuePtr hash = hashOf(size);
+            malValueVec args { mal::keyword(":new"), mal::integer(0) };
+            const malHash* h = STATIC_CAST(malHash, hash);
+            b.start();
+            for (int64_t i = 0; i < b.iterations(); i++) {
+                s_sink = h->assoc(args.begin(), args.end());
+            }
+            b.stop();
+        }});
+        cases.push_back({ STRF("HashGet/size=%d", size),
+                          [=](Benchmark& b) {
+            malValuePtr hash = hashOf(size);
+            malValuePtr key = mal::keyword(STRF(":k%d", size / 2));
+            const malHash* h = STATIC_CAST(malHash, hash);
+            b.start();
+            for (int64_t i = 0; i < b.iterations(); i++) {
+                s_sink = h->get(key);
+            }
+            b.stop();
+        }});
+    }
+
+    for (bool isVector : { false, true }) {
+        const char* type = isVector ? "vector" : "list";
+        for (int size : { 8, 1024 }) {
+            cases.push_back({ STRF("SeqRest/%s/size=%d", type, size),
+                              [=](Benchmark& b) {
+                malValuePtr seq = integers(size, isVector);
+                const malSequence* s = STATIC_CAST(malSequence, seq);
+                b.start();
+                for (int64_t i = 0; i < b.iterations(); i++) {
+                    s_sink = s->rest();
+                }
+                b.stop();
+            }});
+            cases.push_back({ STRF("SeqConj/%s/size=%d", type, size),
+                              [=](Benchmark& b) {
+                malValuePtr seq = integers(size, isVector);
+                const malSequence* s = STATIC_CAST(malSequence, seq);
+                malValueVec args { mal::integer(0) };
+                b.start();
+                for (int64_t i = 0; i < b.iterations(); i++) {
+                    s_sink = s->conj(args.begin(), args.end());
+                }
+                b.stop();
+            }});
+        }
+    }
+}
+
+static void addApplyBenchmarks(std::vector<BenchCase>& cases)
+{
+    auto apply = [](const char* source) {
+        return [=](Benchmark& b) {
+            malValuePtr op = EVAL(readStr(source), s_env);
+            malValueVec args { mal::integer(1), mal::integer(2) };
+            b.start();
+            for (int64_t i = 0; i < b.iterations(); i++) {
+                s_sink = APPLY(op, args.begin(), args.end());
+            }
+            b.stop();
+        };
+    };
+    cases.push_back({ "Apply/builtin", apply("+") });
+    cases.push_back({ "Apply/lambda", apply("(fn* [a b] (+ a b))") });
+}
+
+// The cost of taking and dropping a reference, and of allocating and
+// freeing a value.
+static void addRefCountBenchmarks(std::vector<BenchCase>& cases)
+{
+    cases.push_back({ "RefCount/copy", [](Benchmark& b) {
+        malValuePtr value = mal::integer(1);
+        b.start();
+        for (int64_t i = 0; i < b.iterations(); i++) {
+            malValuePtr copy = value;
+            s_sink = copy;
+        }
+        b.stop();
+    }});
+    cases.push_back({ "RefCount/allocate", [](Benchmark& b) {
+        b.start();
+        for (int64_t i = 0; i < b.iterations(); i++) {
+            s_sink = mal::integer(i);
+        }
+        b.stop();
+    }});
+}
+
+// Doubles the number of iterations until a run lasts long enough, as
+// Go's benchmarks do, and then runs once more at the size that should
+// take the time wanted.
+static Benchmark runCase(const BenchCase& c, int64_t targetNanos)
+{
+    int64_t iterations = 1;
+    for (;;) {
+        Benchmark b(iterations);
+        c.run(b);
+        s_sink = NULL;
+        if (b.nanos() >= targetNanos || iterations >= (1LL << 40)) {
+            return b;
+        }
+        int64_t next = b.nanos() > 0
+            ? iterations * targetNanos / b.nanos() * 6 / 5
+            : iterations * 100;
+        iterations = std::min(std::max(next, iterations * 2),
+                              iterations * 100);
+    }
+}
+
+int main(int argc, char* argv[])
+{
+    int count = 1;
+    int64_t targetMillis = 500;
+    String pattern;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-count") == 0 && i + 1 < argc) {
+            count = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "-time") == 0 && i + 1 < argc) {
+            targetMillis = atoi(argv[++i]);
+        }
+        else if (argv[i][0] != '-') {
+            pattern = argv[i];
+        }
+        else {
+            std::cerr << "Usage: microbench [-count n] [-time ms] "
+                         "[substring]\n";
+            return 1;
+        }
+    }
+
+    installCore(s_env);
+    std::vector<BenchCase> cases;
+    addReaderBenchmarks(cases);
+    addEnvBenchmarks(cases);
+    addCollectionBenchmarks(cases);
+    addApplyBenchmarks(cases);
+    addRefCountBenchmarks(cases);
+
+    try {
+        for (auto& c : cases) {
+            if (c.name.find(pattern) == String::npos) {
+                continue;
+            }
+            for (int i = 0; i < count; i++) {
+                Benchmark b = runCase(c, targetMillis * 1000000);
+                std::cout << b.result(c.name) << std::endl;
+            }
+        }
+    }
+    catch (malValuePtr& mv) {
+        std::cerr << "microbench: " << mv->print(true) << "\n";
+        return 1;
+    }
+    catch (String& s) {
+        std::cerr << "microbench: " << s << "\n";
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,70 @@
+#include "MAL.h"
+
+#include "Serialize.h"
+#include "Types.h"
+
+#include <fstream>
+#include <iostream>
+
+// Reads the prelude files at build time, and writes out C++ source holding
+// their forms in serialized form, so that stepA_mal needn't parse them
+// when it starts.
+//
+//     mkprelude prelude.mal... > Prelude.cpp
+
+static String slurp(const char* filename)
+{
+    std::ifstream file(filename, std::ios::in | std::ios::binary);
+    MAL_CHECK(!file.fail(), "Cannot open %s", filename);
+    return String(std::istreambuf_iterator<char>(file.rdbuf()),
+                  std::istreambuf_iterator<char>());
+}
+
+int main(int argc, char* argv[])
+{
+    String data;
+    try {
+        String source;
+        for (int i = 1; i < argc; i++) {
+            source += slurp(argv[i]) + "\n";
+        }
+        data = serialize(readStr("(do " + source + "nil)"));
+    }
+    catch (String& s) {
+        std::cerr << "mkprelude: " << s << "\n";
+        return 1;
+    }
+
+    std::cout << "// Generated by mkprelude. Do not edit.\n\n"
+              << "#include <cstddef>\n\n"
+              << "extern const char preludeData[] = {";
+    for (size_t i = 0; i < data.size(); i++) {
+        std::cout << ((i % 16 == 0) ? "\n    " : " ")
+                  << static_cast<int>(static_cast<signed char>(data[i]))
+                  << ",";
+    }
+    std::cout << "\n};\n\n"
+              << "extern const size_t preludeSize = " << data.size() << ";\n";
+    return 0;
+}
+
+// The prelude is only read, never evaluated.
+malValuePtr EVAL(malValuePtr ast, malEnvPtr)
+{
+    return ast;
+}
+
+malValuePtr APPLY(malValuePtr ast, malValueIter, malValueIter)
+{
+    return ast;
+}
+
+malValuePtr readline(const String& prompt)
+{
+    return mal::nilValue();
+}
+
+String rep(const String& input, malEnvPtr env)
+{
+    return input;
+}
@@ -1,12 +1,22 @@
 #include "MAL.h"
 
+#include "Channel.h"
 #include "Environment.h"
+#include "FlightRecorder.h"
+#include "HeapDump.h"
+#include "Profiler.h"
 #include "ReadLine.h"
+#include "Serialize.h"
+#include "Stats.h"
+#include "ThreadPool.h"
 #include "Types.h"
 
 #include <iostream>
+#include <cstring>
 #include <memory>
 
+#include <unistd.h>
+
 malValuePtr READ(const String& input);
 String PRINT(malValuePtr ast);
 static void installFunctions(malEnvPtr env);
@@ -14,8 +24,14 @@ static void installFunctions(malEnvPtr env);
 
 static void makeArgv(malEnvPtr env, int argc, char* argv[]);
 static String safeRep(const String& input, malEnvPtr env);
+static void runScript(const char* path);
+static void stopProfilers(const String& profilePath,
+                          const String& allocProfilePath,
+                          const String& tracePath,
+                          const String& metricsPath);
 static malValuePtr quasiquote(malValuePtr obj);
-static malValuePtr macroExpand(malValuePtr obj, malEnvPtr env);
+static void macroExpand(malValuePtr& obj, const malEnvPtr& env);
+static void setStackLimit(const char* limit);
 
 static ReadLine s_readLine("~/.mal-history");
 
@@ -25,12 +41,94 @@ int main(int argc, char* argv[])
 {
     String prompt = "user> ";
     String input;
+    setStackLimit(getenv("MAL_STACK_LIMIT"));
+
+    // --load-image restores the global environment saved by --save-image,
+    // which is written once any script given has been run. --profile
+    // samples the whole run, --alloc-profile counts its allocations, and
+    // --trace records its calls and reads. --metrics writes the runtime
+    // stats out every --metrics-interval seconds, for monitoring.
+    String loadImagePath, saveImagePath, profilePath, allocProfilePath;
+    String tracePath, metricsPath;
+    int metricsInterval = 15;
+    int argi = 1;
+    for (; argi + 1 < argc; argi += 2) {
+        if (strcmp(argv[argi], "--load-image") == 0) {
+            loadImagePath = argv[argi + 1];
+        }
+        else if (strcmp(argv[argi], "--save-image") == 0) {
+            saveImagePath = argv[argi + 1];
+        }
+        else if (strcmp(argv[argi], "--profile") == 0) {
+            profilePath = escape(argv[argi + 1]);
+        }
+        else if (strcmp(argv[argi], "--alloc-profile") == 0) {
+            allocProfilePath = escape(argv[argi + 1]);
+        }
+        else if (strcmp(argv[argi], "--trace") == 0) {
+            tracePath = escape(argv[argi + 1]);
+        }
+        else if (strcmp(argv[argi], "--metrics") == 0) {
+            metricsPath = argv[argi + 1];
+        }
+        else if (strcmp(argv[argi], "--metrics-interval") == 0) {
+            metricsInterval = atoi(argv[argi + 1]);
+        }
+        else {
+            break;
+        }
+    }
+    if (!metricsPath.empty()) {
+        try {
+            RuntimeStats::exportMetrics(metricsPath, metricsInterval);
+        }
+        catch (String& s) {
+            std::cerr << "Error: " << s << "\n";
+            return 1;
+        }
+    }
+
     installCore(replEnv);
-    installFunctions(replEnv);
-    makeArgv(replEnv, argc - 2, argv + 2);
-    if (argc > 1) {
-        String filename = escape(argv[1]);
-        safeRep(STRF("(load-file %s)", filename.c_str()), replEnv);
+    FlightRecorder::install(replEnv);
+    try {
+        if (!loadImagePath.empty()) {
+            loadImage(loadImagePath, replEnv);
+        }
+        else {
+            installFunctions(replEnv);
+        }
+    }
+    catch (String& s) {
+        std::cerr << "Error: " << s << "\n";
+        return 1;
+    }
+    makeArgv(replEnv, argc - argi - 1, argv + argi + 1);
+    if (!profilePath.empty()) {
+        safeRep("(profile-start)", replEnv);
+    }
+    if (!allocProfilePath.empty()) {
+        safeRep("(alloc-profile-start)", replEnv);
+    }
+    if (!tracePath.empty()) {
+        safeRep("(trace-start)", replEnv);
+    }
+    if (argi < argc) {
+        runScript(argv[argi]);
+    }
+    if (argi < argc || !saveImagePath.empty()) {
+        stopProfilers(profilePath, allocProfilePath, tracePath,
+                      metricsPath);
+    }
+    if (!saveImagePath.empty()) {
+        try {
+            saveImage(saveImagePath, replEnv);
+        }
+        catch (String& s) {
+            std::cerr << "Error: " << s << "\n";
+            return 1;
+        }
+    }
+    if ((argi < argc) || !saveImagePath.empty()) {
         return 0;
     }
     rep("(println (str \"Mal [\" *host-language* \"]\"))", replEnv);
@@ -39,9 +137,55 @@ int main(int argc, char* argv[])
         if (out.length() > 0)
             std::cout << out << "\n";
     }
+    stopProfilers(profilePath, allocProfilePath, tracePath, metricsPath);
     return 0;
 }
 
+// Writes the reports of any profilers started from the command line, and
+// the final metrics.
+static void stopProfilers(const String& profilePath,
+                          const String& allocProfilePath,
+                          const String& tracePath,
+                          const String& metricsPath)
+{
+    if (!profilePath.empty()) {
+        safeRep(STRF("(profile-stop %s)", profilePath.c_str()), replEnv);
+    }
+    if (!allocProfilePath.empty()) {
+        safeRep(STRF("(alloc-profile-report %s)", allocProfilePath.c_str()),
+                replEnv);
+    }
+    if (!tracePath.empty()) {
+        safeRep(STRF("(trace-stop %s)", tracePath.c_str()), replEnv);
+    }
+    if (!metricsPath.empty()) {
+        try {
+            RuntimeStats::writeMetrics(metricsPath);
+        }
+        catch (String& s) {
+            std::cerr << "Error: " << s << "\n";
+        }
+    }
+}
+
+// An uncaught error ends the script, with the flight recorder showing what
+// led up to it.
+static void runScript(const char* path)
+{
+    String error;
+    try {
+        rep(STRF("(load-file %s)", escape(path).c_str()), replEnv);
+        return;
+    }
+    catch (malValuePtr& mv) {
+        error = mv->print(true);
+    }
+    catch (String& s) {
+        error = s;
+    }
+    std::cerr << FlightRecorder::dump(("uncaught error: " + error).c_str());
+}
+
 static String safeRep(const String& input, malEnvPtr env)
 {
     try {
@@ -77,175 +221,595 @@ malValuePtr READ(const String& input)
     return readStr(input);
 }
 
-malValuePtr EVAL(malValuePtr ast, malEnvPtr env)
+// EVAL keeps the mal call stack on the heap, rather than recursing natively
+// for every sub-expression, so that deep non-tail recursion is bounded by
+// s_maxFrames rather than by the size of the C++ stack.
+//
+// Each pending computation is a Frame, waiting for the value of the
+// expression being evaluated. Evaluated arguments are kept in a separate
+// value stack, so a frame is a small fixed-size record and both stacks are
+// contiguous in memory.
+//
+// Frames also note the depth of the CallStack, which is cut back to that
+// whenever evaluation returns to them.
+
+struct Frame {
+    enum Kind { CALL, DEF, DEFMACRO, DO, IF, LET, THEN, TRY, VECTOR };
+
+    Frame(Kind kind, int next, int base, const malSequence* seq,
+          const malValuePtr& form, const malEnvPtr& env, size_t callDepth)
+    : kind(kind), next(next), base(base), seq(seq), form(form), env(env)
+    , callDepth(callDepth) { }
+
+    Kind                kind;
+    int                 next;   // index of the next item to evaluate
+    int                 base;   // size of the value stack when pushed
+    const malSequence*  seq;    // the items being walked, owned by form
+    malValuePtr         form;
+    malEnvPtr           env;
+    size_t              callDepth;
+};
+
+class EvalStack {
+public:
+    static EvalStack* acquire();
+    static void release(EvalStack* stack);
+
+    void push(Frame::Kind kind, int next, const malSequence* seq,
+              const malValuePtr& form, const malEnvPtr& env);
+    void pop();
+    bool unwindToTry();
+
+    bool apply(int base, malValuePtr& ast, malEnvPtr& env, malValuePtr& value);
+
+    std::vector<Frame> frames;
+    malValueVec        values;
+    size_t             callBase; // the CallStack depth EVAL started at
+
+private:
+    static thread_local std::vector<EvalStack*> t_pool;
+};
+
+thread_local std::vector<EvalStack*> EvalStack::t_pool;
+
+// The limit applies to each thread separately.
+static thread_local size_t t_frameCount = 0;
+static size_t s_maxFrames = (32 << 20) / sizeof(Frame);
+
+// The limit is given in bytes, with an optional K, M or G suffix.
+static void setStackLimit(const char* limit)
 {
-    if (!env) {
-        env = replEnv;
+    if (limit == NULL) {
+        return;
+    }
+    char* suffix;
+    unsigned long long bytes = strtoull(limit, &suffix, 10);
+    switch (*suffix) {
+        case 'G': case 'g': bytes <<= 10; // fall through
+        case 'M': case 'm': bytes <<= 10; // fall through
+        case 'K': case 'k': bytes <<= 10; break;
+    }
+    if (bytes >= sizeof(Frame)) {
+        s_maxFrames = bytes / sizeof(Frame);
+    }
+}
+
+// Stacks are recycled rather than freed, so that their capacity is reused
+// by the next (possibly nested) call to EVAL on the same thread.
+EvalStack* EvalStack::acquire()
+{
+    if (t_pool.empty()) {
+        EvalStack* stack = new EvalStack;
+        stack->frames.reserve(64);
+        stack->values.reserve(256);
+        return stack;
+    }
+    EvalStack* stack = t_pool.back();
+    t_pool.pop_back();
+    return stack;
+}
+
+void EvalStack::release(EvalStack* stack)
+{
+    t_frameCount -= stack->frames.size();
+    stack->frames.clear();
+    stack->values.clear();
+    t_pool.push_back(stack);
+}
+
+void EvalStack::push(Frame::Kind kind, int next, const malSequence* seq,
+                     const malValuePtr& form, const malEnvPtr& env)
+{
+    MAL_CHECK(t_frameCount < s_maxFrames,
+              "Stack overflow: more than %zu frames", s_maxFrames);
+    ++t_frameCount;
+    frames.emplace_back(kind, next, (int)values.size(), seq, form, env,
+                        CallStack::depth());
+}
+
+void EvalStack::pop()
+{
+    --t_frameCount;
+    frames.pop_back();
+}
+
+// Discards frames down to the innermost try*, if there is one.
+bool EvalStack::unwindToTry()
+{
+    while (!frames.empty()) {
+        if (frames.back().kind == Frame::TRY) {
+            values.resize(frames.back().base);
+            return true;
+        }
+        pop();
     }
+    return false;
+}
+
+// Applies the function at values[base] to the values above it, in tail
+// position. Returns true if evaluation continues with the body of a lambda
+// in ast and env, or false if the result is in value.
+bool EvalStack::apply(int base, malValuePtr& ast, malEnvPtr& env,
+                      malValuePtr& value)
+{
     while (1) {
-        const malList* list = DYNAMIC_CAST(malList, ast);
-        if (!list || (list->count() == 0)) {
-            return ast->eval(env);
+        malValueIter items = values.begin() + base;
+        malValuePtr op = *items;
+        if (const malLambda* lambda = DYNAMIC_CAST(malLambda, op)) {
+            env = lambda->makeEnv(items + 1, values.end());
+            ast = lambda->getBody();
+            size_t callerDepth = frames.empty() ? callBase
+                                                : frames.back().callDepth;
+            RuntimeStats::count(RuntimeStats::LambdaCalls);
+            if (CallStack::depth() > callerDepth) {
+                RuntimeStats::count(RuntimeStats::TailCalls);
+            }
+            CallStack::truncate(callerDepth);
+            CallStack::push(lambda);
+            values.resize(base);
+            return true; // TCO
         }
 
-        ast = macroExpand(ast, env);
-        list = DYNAMIC_CAST(malList, ast);
-        if (!list || (list->count() == 0)) {
-            return ast->eval(env);
+        // Builtins which call back into EVAL get a stack of their own, so
+        // these iterators remain valid.
+        if (const malBuiltIn* builtin = DYNAMIC_CAST(malBuiltIn, op)) {
+            value = builtin->applyTail(items + 1, values.end());
         }
+        else {
+            value = APPLY(op, items + 1, values.end());
+        }
+        values.resize(base);
 
-        // From here on down we are evaluating a non-empty list.
-        // First handle the special forms.
-        if (const malSymbol* symbol = DYNAMIC_CAST(malSymbol, list->item(0))) {
-            String special = symbol->value();
-            int argCount = list->count() - 1;
+        const malTailCall* tailCall = DYNAMIC_CAST(malTailCall, value);
+        if (!tailCall) {
+            return false;
+        }
+        if (!tailCall->then().empty()) {
+            push(Frame::THEN, 0, NULL, value, env);
+            base = values.size();
+        }
+        values.insert(values.end(), tailCall->call().begin(),
+                      tailCall->call().end());
+    }
+}
 
-            if (special == "def!") {
-                checkArgsIs("def!", 2, argCount);
-                const malSymbol* id = VALUE_CAST(malSymbol, list->item(1));
-                return env->set(id->value(), EVAL(list->item(2), env));
-            }
+// Also gives heap dumps the values on the stack, and those EVAL is working
+// on.
+class EvalStackHolder : public HeapRoots {
+public:
+    EvalStackHolder(const malValuePtr& ast, const malEnvPtr& env,
+                    const malValuePtr& value)
+    : m_stack(EvalStack::acquire()), m_ast(ast), m_env(env), m_value(value) {
+        m_stack->callBase = CallStack::depth();
+    }
+    ~EvalStackHolder() {
+        CallStack::truncate(m_stack->callBase);
+        EvalStack::release(m_stack);
+    }
 
-            if (special == "defmacro!") {
-                checkArgsIs("defmacro!", 2, argCount);
+    EvalStack* get() const { return m_stack; }
 
-                const malSymbol* id = VALUE_CAST(malSymbol, list->item(1));
-                malValuePtr body = EVAL(list->item(2), env);
-                const malLambda* lambda = VALUE_CAST(malLambda, body);
-                return env->set(id->value(), mal::macro(*lambda));
+    virtual void addRoots(std::vector<const RefCounted*>& roots) const {
+        for (auto& frame : m_stack->frames) {
+            roots.push_back(frame.form.ptr());
+            roots.push_back(frame.env.ptr());
+        }
+        for (auto& value : m_stack->values) {
+            roots.push_back(value.ptr());
+        }
+        for (const RefCounted* local : { (const RefCounted*)m_ast.ptr(),
+                                         (const RefCounted*)m_env.ptr(),
+                                         (const RefCounted*)m_value.ptr() }) {
+            if (local != NULL) {
+                roots.push_back(local);
             }
+        }
+    }
 
-            if (special == "do") {
-                checkArgsAtLeast("do", 1, argCount);
-
-                for (int i = 1; i < argCount; i++) {
-                    EVAL(list->item(i), env);
-                }
-                ast = list->item(argCount);
-                continue; // TCO
-            }
+private:
+    EvalStack*          m_stack;
+    const malValuePtr&  m_ast;
+    const malEnvPtr&    m_env;
+    const malValuePtr&  m_value;
+};
 
-            if (special == "fn*") {
-                checkArgsIs("fn*", 2, argCount);
+// Environments are shared between threads without locking, so parallel
+// tasks may only modify the environments they create. Other threads
+// def! through malEnv::define, which copies what tasks may be reading.
+static void checkNotInTask(const char* special)
+{
+    MAL_CHECK(!ThreadPool::isInTask(),
+              "%s is not allowed in a parallel task", special);
+    MAL_CHECK(!isInGoBlock(), "%s is not allowed in a go block", special);
+}
 
-                const malSequence* bindings =
-                    VALUE_CAST(malSequence, list->item(1));
-                StringVec params;
-                for (int i = 0; i < bindings->count(); i++) {
-                    const malSymbol* sym =
-                        VALUE_CAST(malSymbol, bindings->item(i));
-                    params.push_back(sym->value());
-                }
+// Values which can be evaluated without recursing into EVAL are done
+// inline, to save a trip around the loop.
+static bool isSimple(const malValuePtr& ast)
+{
+    return !DYNAMIC_CAST(malSequence, ast);
+}
 
-                return mal::lambda(params, list->item(2), env);
-            }
+malValuePtr EVAL(malValuePtr ast, malEnvPtr env)
+{
+    if (!env) {
+        env = replEnv;
+    }
 
-            if (special == "if") {
-                checkArgsBetween("if", 2, 3, argCount);
+    malValuePtr value;
+    EvalStackHolder holder(ast, env, value);
+    EvalStack* stack = holder.get();
+    bool isReturning = false;
 
-                bool isTrue = EVAL(list->item(1), env)->isTrue();
-                if (!isTrue && (argCount == 2)) {
-                    return mal::nilValue();
+    while (1) {
+        RuntimeStats::count(RuntimeStats::EvalSteps);
+        try {
+            if (isReturning) {
+                if (stack->frames.empty()) {
+                    return value;
+                }
+                Frame& frame = stack->frames.back();
+                CallStack::truncate(frame.callDepth);
+                switch (frame.kind) {
+                    case Frame::CALL:
+                    case Frame::VECTOR: {
+                        stack->values.push_back(value);
+                        const malSequence* seq = frame.seq;
+                        int count = seq->count();
+                        while (frame.next < count &&
+                               isSimple(seq->item(frame.next))) {
+                            stack->values.push_back(
+                                seq->item(frame.next++)->eval(frame.env));
+                        }
+                        if (frame.next < count) {
+                            ast = seq->item(frame.next++);
+                            env = frame.env;
+                            isReturning = false;
+                            continue;
+                        }
+
+                        int base = frame.base;
+                        bool isVector = (frame.kind == Frame::VECTOR);
+                        stack->pop();
+                        if (isVector) {
+                            value = mal::vector(stack->values.begin() + base,
+                                                stack->values.end());
+                            stack->values.resize(base);
+                            continue;
+                        }
+                        isReturning = !stack->apply(base, ast, env, value);
+                        continue;
+                    }
+
+                    case Frame::DEF: {
+                        const malSymbol* id =
+                            STATIC_CAST(malSymbol, frame.seq->item(1));
+                        frame.env->define(id->value(), value);
+                        stack->pop();
+                        continue;
+                    }
+
+                    case Frame::DEFMACRO: {
+                        const malSymbol* id =
+                            STATIC_CAST(malSymbol, frame.seq->item(1));
+                        const malLambda* lambda = VALUE_CAST(malLambda, value);
+                        value = frame.env->define(id->value(),
+                                                  mal::macro(*lambda));
+                        stack->pop();
+                        continue;
+                    }
+
+                    case Frame::DO: {
+                        ast = frame.seq->item(frame.next++);
+                        env = frame.env;
+                        if (frame.next == frame.seq->count()) {
+                            stack->pop(); // TCO
+                        }
+                        isReturning = false;
+                        continue;
+                    }
+
+                    case Frame::IF: {
+                        bool isTrue = value->isTrue();
+                        if (!isTrue && (frame.seq->count() == 3)) {
+                            value = mal::nilValue();
+                            stack->pop();
+                            continue;
+                        }
+                        ast = frame.seq->item(isTrue ? 2 : 3);
+                        env = frame.env;
+                        stack->pop();
+                        isReturning = false;
+                        continue; // TCO
+                    }
+
+                    case Frame::LET: {
+                        const malSequence* bindings = frame.seq;
+                        const malSymbol* var =
+                            STATIC_CAST(malSymbol, bindings->item(frame.next));
+                        frame.env->set(var->value(), value);
+                        frame.next += 2;
+                        env = frame.env;
+                        if (frame.next < bindings->count()) {
+                            ast = bindings->item(frame.next + 1);
+                        }
+                        else {
+                            ast = STATIC_CAST(malSequence, frame.form)->item(2);
+                            stack->pop(); // TCO
+                        }
+                        isReturning = false;
+                        continue;
+                    }
+
+                    case Frame::THEN: {
+                        // Apply the continuation of a builtin's tail call
+                        // to its arguments and the result of the call.
+                        const malTailCall* tailCall =
+                            STATIC_CAST(malTailCall, frame.form);
+                        int base = frame.base;
+                        stack->values.insert(stack->values.end(),
+                                             tailCall->then().begin(),
+                                             tailCall->then().end());
+                        stack->values.push_back(value);
+                        stack->pop();
+                        isReturning = !stack->apply(base, ast, env, value);
+                        continue;
+                    }
+
+                    case Frame::TRY: {
+                        stack->pop();
+                        continue;
+                    }
                 }
-                ast = list->item(isTrue ? 2 : 3);
-                continue; // TCO
             }
 
-            if (special == "let*") {
-                checkArgsIs("let*", 2, argCount);
-                const malSequence* bindings =
-                    VALUE_CAST(malSequence, list->item(1));
-                int count = checkArgsEven("let*", bindings->count());
-                malEnvPtr inner(new malEnv(env));
-                for (int i = 0; i < count; i += 2) {
-                    const malSymbol* var =
-                        VALUE_CAST(malSymbol, bindings->item(i));
-                    inner->set(var->value(), EVAL(bindings->item(i+1), inner));
+            const malList* list = DYNAMIC_CAST(malList, ast);
+            if (!list || (list->count() == 0)) {
+                const malVector* vec = DYNAMIC_CAST(malVector, ast);
+                if (vec && !vec->isEmpty()) {
+                    // Evaluate the first item, and let the frame take
+                    // care of the rest.
+                    stack->push(Frame::VECTOR, 1, vec, ast, env);
+                    ast = vec->item(0);
+                    continue;
                 }
-                ast = list->item(2);
-                env = inner;
-                continue; // TCO
+                value = ast->eval(env);
+                isReturning = true;
+                continue;
             }
 
-            if (special == "macroexpand") {
-                checkArgsIs("macroexpand", 1, argCount);
-                return macroExpand(list->item(1), env);
+            macroExpand(ast, env);
+            list = DYNAMIC_CAST(malList, ast);
+            if (!list || (list->count() == 0)) {
+                value = ast->eval(env);
+                isReturning = true;
+                continue;
             }
 
-            if (special == "quasiquoteexpand") {
-                checkArgsIs("quasiquote", 1, argCount);
-                return quasiquote(list->item(1));
-            }
+            // From here on down we are evaluating a non-empty list.
+            // First handle the special forms.
+            if (const malSymbol* symbol =
+                    DYNAMIC_CAST(malSymbol, list->item(0))) {
+                const String& special = symbol->value();
+                int argCount = list->count() - 1;
+
+                if (special == "def!") {
+                    FlightRecorder::noteSpecialForm("def!");
+                    checkArgsIs("def!", 2, argCount);
+                    checkNotInTask("def!");
+                    VALUE_CAST(malSymbol, list->item(1));
+                    stack->push(Frame::DEF, 0, list, ast, env);
+                    ast = list->item(2);
+                    continue;
+                }
 
-            if (special == "quasiquote") {
-                checkArgsIs("quasiquote", 1, argCount);
-                ast = quasiquote(list->item(1));
-                continue; // TCO
-            }
+                if (special == "defmacro!") {
+                    FlightRecorder::noteSpecialForm("defmacro!");
+                    checkArgsIs("defmacro!", 2, argCount);
+                    checkNotInTask("defmacro!");
+                    VALUE_CAST(malSymbol, list->item(1));
+                    stack->push(Frame::DEFMACRO, 0, list, ast, env);
+                    ast = list->item(2);
+                    continue;
+                }
 
-            if (special == "quote") {
-                checkArgsIs("quote", 1, argCount);
-                return list->item(1);
-            }
+                if (special == "do") {
+                    FlightRecorder::noteSpecialForm("do");
+                    checkArgsAtLeast("do", 1, argCount);
 
-            if (special == "try*") {
-                malValuePtr tryBody = list->item(1);
+                    if (argCount > 1) {
+                        stack->push(Frame::DO, 2, list, ast, env);
+                    }
+                    ast = list->item(1);
+                    continue; // TCO when there is only one form
+                }
 
-                if (argCount == 1) {
-                    ast = EVAL(tryBody, env);
-                    continue; // TCO
+                if (special == "fn*") {
+                    FlightRecorder::noteSpecialForm("fn*");
+                    checkArgsIs("fn*", 2, argCount);
+
+                    const malSequence* bindings =
+                        VALUE_CAST(malSequence, list->item(1));
+                    StringVec params;
+                    for (int i = 0; i < bindings->count(); i++) {
+                        const malSymbol* sym =
+                            VALUE_CAST(malSymbol, bindings->item(i));
+                        params.push_back(sym->value());
+                    }
+
+                    value = mal::lambda(params, list->item(2), env);
+                    isReturning = true;
+                    continue;
                 }
-                checkArgsIs("try*", 2, argCount);
-                const malList* catchBlock = VALUE_CAST(malList, list->item(2));
-
-                checkArgsIs("catch*", 2, catchBlock->count() - 1);
-                MAL_CHECK(VALUE_CAST(malSymbol,
-                    catchBlock->item(0))->value() == "catch*",
-                    "catch block must begin with catch*");
-
-                // We don't need excSym at this scope, but we want to check
-                // that the catch block is valid always, not just in case of
-                // an exception.
-                const malSymbol* excSym =
-                    VALUE_CAST(malSymbol, catchBlock->item(1));
 
-                malValuePtr excVal;
+                if (special == "if") {
+                    FlightRecorder::noteSpecialForm("if");
+                    checkArgsBetween("if", 2, 3, argCount);
 
-                try {
-                    ast = EVAL(tryBody, env);
+                    stack->push(Frame::IF, 0, list, ast, env);
+                    ast = list->item(1);
+                    continue;
                 }
-                catch(String& s) {
-                    excVal = mal::string(s);
+
+                if (special == "let*") {
+                    FlightRecorder::noteSpecialForm("let*");
+                    checkArgsIs("let*", 2, argCount);
+                    const malSequence* bindings =
+                        VALUE_CAST(malSequence, list->item(1));
+                    int count = checkArgsEven("let*", bindings->count());
+                    for (int i = 0; i < count; i += 2) {
+                        VALUE_CAST(malSymbol, bindings->item(i));
+                    }
+                    malEnvPtr inner(new malEnv(env));
+                    env = inner;
+                    if (count == 0) {
+                        ast = list->item(2);
+                        continue; // TCO
+                    }
+                    stack->push(Frame::LET, 0, bindings, ast, inner);
+                    ast = bindings->item(1);
+                    continue;
+                }
+
+                if (special == "macroexpand") {
+                    FlightRecorder::noteSpecialForm("macroexpand");
+                    checkArgsIs("macroexpand", 1, argCount);
+                    value = list->item(1);
+                    macroExpand(value, env);
+                    isReturning = true;
+                    continue;
+                }
+
+                if (special == "quasiquoteexpand") {
+                    FlightRecorder::noteSpecialForm("quasiquoteexpand");
+                    checkArgsIs("quasiquote", 1, argCount);
+                    value = quasiquote(list->item(1));
+                    isReturning = true;
+                    continue;
+                }
+
+                if (special == "quasiquote") {
+                    FlightRecorder::noteSpecialForm("quasiquote");
+                    checkArgsIs("quasiquote", 1, argCount);
+                    ast = quasiquote(list->item(1));
+                    continue; // TCO
                 }
-                catch (malEmptyInputException&) {
-                    // Not an error, continue as if we got nil
-                    ast = mal::nilValue();
+
+                if (special == "quote") {
+                    FlightRecorder::noteSpecialForm("quote");
+                    checkArgsIs("quote", 1, argCount);
+                    value = list->item(1);
+                    isReturning = true;
+                    continue;
                 }
-                catch(malValuePtr& o) {
-                    excVal = o;
-                };
-
-                if (excVal) {
-                    // we got some exception
-                    env = malEnvPtr(new malEnv(env));
-                    env->set(excSym->value(), excVal);
-                    ast = catchBlock->item(2);
+
+                if (special == "try*") {
+                    FlightRecorder::noteSpecialForm("try*");
+                    malValuePtr tryBody = list->item(1);
+
+                    if (argCount == 1) {
+                        ast = tryBody;
+                        continue; // TCO
+                    }
+                    checkArgsIs("try*", 2, argCount);
+                    const malList* catchBlock =
+                        VALUE_CAST(malList, list->item(2));
+
+                    checkArgsIs("catch*", 2, catchBlock->count() - 1);
+                    MAL_CHECK(VALUE_CAST(malSymbol,
+                        catchBlock->item(0))->value() == "catch*",
+                        "catch block must begin with catch*");
+
+                    // We don't need excSym at this scope, but we want to
+                    // check that the catch block is valid always, not just
+                    // in case of an exception.
+                    VALUE_CAST(malSymbol, catchBlock->item(1));
+
+                    stack->push(Frame::TRY, 0, list, ast, env);
+                    ast = tryBody;
+                    continue;
                 }
-                continue; // TCO
             }
-        }
 
-        // Now we're left with the case of a regular list to be evaluated.
-        std::unique_ptr<malValueVec> items(list->evalItems(env));
-        malValuePtr op = items->at(0);
-        if (const malLambda* lambda = DYNAMIC_CAST(malLambda, op)) {
-            ast = lambda->getBody();
-            env = lambda->makeEnv(items->begin()+1, items->end());
-            continue; // TCO
+            // Now we're left with the case of a regular list to be
+            // evaluated. Simple items are evaluated straight away, and the
+            // frame takes over at the first one which isn't.
+            stack->push(Frame::CALL, 0, list, ast, env);
+            Frame& frame = stack->frames.back();
+            int count = list->count();
+            while (frame.next < count && isSimple(list->item(frame.next))) {
+                stack->values.push_back(
+                    list->item(frame.next++)->eval(env));
+            }
+            if (frame.next < count) {
+                ast = list->item(frame.next++);
+                continue;
+            }
+            // Every item was simple, so pop the last value back off, and
+            // let the frame apply the function.
+            value = stack->values.back();
+            stack->values.pop_back();
+            isReturning = true;
+            continue;
         }
-        else {
-            return APPLY(op, items->begin()+1, items->end());
+        // If there is no try* on this stack, the exception propagates out
+        // to our caller, otherwise we fall through to the catch* below.
+        catch (String& s) {
+            if (!stack->unwindToTry()) {
+                throw;
+            }
+            value = mal::string(s);
         }
+        catch (malEmptyInputException&) {
+            if (!stack->unwindToTry()) {
+                throw;
+            }
+            // Not an error, continue as if we got nil
+            value = malValuePtr();
+        }
+        catch (malValuePtr& o) {
+            if (!stack->unwindToTry()) {
+                throw;
+            }
+            value = o;
+        };
+
+        RuntimeStats::count(RuntimeStats::ExceptionsCaught);
+        const Frame& frame = stack->frames.back();
+        CallStack::truncate(frame.callDepth);
+        if (!value) {
+            value = mal::nilValue();
+            stack->pop();
+            isReturning = true;
+            continue;
+        }
+        const malList* catchBlock = STATIC_CAST(malList, frame.seq->item(2));
+        const malSymbol* excSym = STATIC_CAST(malSymbol, catchBlock->item(1));
+        env = malEnvPtr(new malEnv(frame.env));
+        env->set(excSym->value(), value);
+        ast = catchBlock->item(2);
+        stack->pop();
+        isReturning = false;
     }
 }
 
@@ -263,14 +827,14 @@ malValuePtr APPLY(malValuePtr op, malValueIter argsBegin, malValueIter argsEnd)
     return handler->apply(argsBegin, argsEnd);
 }
 
-static bool isSymbol(malValuePtr obj, const String& text)
+static bool isSymbol(const malValuePtr& obj, const char* text)
 {
     const malSymbol* sym = DYNAMIC_CAST(malSymbol, obj);
     return sym && (sym->value() == text);
 }
 
 //  Return arg when ast matches ('sym, arg), else NULL.
-static malValuePtr starts_with(const malValuePtr ast, const char* sym)
+static malValuePtr starts_with(const malValuePtr& ast, const char* sym)
 {
     const malList* list = DYNAMIC_CAST(malList, ast);
     if (!list || list->isEmpty() || !isSymbol(list->item(0), sym))
@@ -306,43 +870,37 @@ static malValuePtr quasiquote(malValuePtr obj)
     return res;
 }
 
-static const malLambda* isMacroApplication(malValuePtr obj, malEnvPtr env)
+static const malLambda* isMacroApplication(const malValuePtr& obj,
+                                           const malEnvPtr& env)
 {
     const malList* seq = DYNAMIC_CAST(malList, obj);
     if (seq && !seq->isEmpty()) {
         if (malSymbol* sym = DYNAMIC_CAST(malSymbol, seq->item(0))) {
-            if (malEnvPtr symEnv = env->find(sym->value())) {
-                malValuePtr value = sym->eval(symEnv);
-                if (malLambda* lambda = DYNAMIC_CAST(malLambda, value)) {
-                    return lambda->isMacro() ? lambda : NULL;
-                }
+            malValuePtr value = env->lookup(sym->value());
+            if (malLambda* lambda = DYNAMIC_CAST(malLambda, value)) {
+                return lambda->isMacro() ? lambda : NULL;
             }
         }
     }
     return NULL;
 }
 
-static malValuePtr macroExpand(malValuePtr obj, malEnvPtr env)
+// Expands obj in place, until it is no longer a macro call.
+static void macroExpand(malValuePtr& obj, const malEnvPtr& env)
 {
     while (const malLambda* macro = isMacroApplication(obj, env)) {
+        RuntimeStats::count(RuntimeStats::MacroExpansions);
         const malSequence* seq = STATIC_CAST(malSequence, obj);
         obj = macro->apply(seq->begin() + 1, seq->end());
     }
-    return obj;
 }
 
-static const char* malFunctionTable[] = {
-    "(defmacro! cond (fn* (& xs) (if (> (count xs) 0) (list 'if (first xs) (if (> (count xs) 1) (nth xs 1) (throw \"odd number of forms to cond\")) (cons 'cond (rest (rest xs)))))))",
-    "(def! not (fn* (cond) (if cond false true)))",
-    "(def! load-file (fn* (filename) \
-        (eval (read-string (str \"(do \" (slurp filename) \"\nnil)\")))))",
-    "(def! *host-language* \"C++\")",
-};
+// Prelude.cpp is generated from prelude.mal by mkprelude.
+extern const char preludeData[];
+extern const size_t preludeSize;
 
 static void installFunctions(malEnvPtr env) {
-    for (auto &function : malFunctionTable) {
-        rep(function, env);
-    }
+    EVAL(deserialize(preludeData, preludeSize, env), env);
 }
 
 // Added to keep the linker happy at step A
@@ -0,0 +1,69 @@
+#!/bin/bash
+
+# Tests of stepA_mal's command line, which the step tests, being run in a
+# single interpreter, can't reach. Run from impls/cpp by make check.
+
+MAL=${MAL:-./stepA_mal}
+TMP=$(mktemp -d)
+trap 'rm -rf $TMP' EXIT
+
+# Nothing should be cached under the real home directory.
+export MAL_CACHE_DIR=
+
+failures=0
+
+expect() {
+    local name=$1 expected=$2 actual=$3
+    if [ "$actual" == "$expected" ]; then
+        echo "ok: $name"
+    else
+        echo "FAIL: $name: expected '$expected', got '$actual'"
+        failures=$((failures + 1))
+    fi
+}
+
+# A closure saved in an image still refers to the global environment, so
+# redefining a global it uses after loading the image is seen.
+cat > $TMP/lib.mal <<'EOF'
+(def! base 40)
+(def! add-base (fn* [x] (+ x base)))
+(defmacro! twice (fn* [form] `(do ~form ~form)))
+EOF
+cat > $TMP/app.mal <<'EOF'
+(prn (add-base 2))
+(def! base 100)
+(prn (add-base 2))
+(def! n (atom 0))
+(twice (swap! n (fn* [x] (+ x 1))))
+(prn @n)
+EOF
+$MAL --save-image $TMP/app.img $TMP/lib.mal
+expect "image round trip" "$(printf '42\n102\n2')" \
+    "$($MAL --load-image $TMP/app.img $TMP/app.mal 2>&1)"
+
+# load-file keeps what it parsed in MAL_CACHE_DIR. The entry is swapped for
+# one which prints something else, to tell when it's used.
+CACHE=$TMP/cache
+echo '(prn :parsed)' > $TMP/cached.mal
+expect "cache miss" ":parsed" \
+    "$(MAL_CACHE_DIR=$CACHE $MAL $TMP/cached.mal 2>&1)"
+entry=$(echo $CACHE/*.malc)
+cat > $TMP/swap.mal <<END
+(def! entry (deserialize-file "$entry"))
+(serialize-file "$entry" [(nth entry 0) '(do (prn :cached) nil)])
+END
+$MAL $TMP/swap.mal
+expect "cache hit" ":cached" \
+    "$(MAL_CACHE_DIR=$CACHE $MAL $TMP/cached.mal 2>&1)"
+echo '(prn :changed)' > $TMP/cached.mal
+expect "cache entry replaced" ":changed $entry" \
+    "$(MAL_CACHE_DIR=$CACHE $MAL $TMP/cached.mal 2>&1) $(echo $CACHE/*)"
+
+# The trace is JSON, so control characters in a span's detail, here a file
+# name, must be escaped.
+printf '(try* (slurp "tab\there") (catch* e nil))\n' > $TMP/trace.mal
+$MAL --trace $TMP/trace.json $TMP/trace.mal
+expect "trace escapes control characters" '"detail":"tab\there"' \
+    "$(grep -o '"detail":"tab[^"]*"' $TMP/trace.json)"
+
+[ $failures == 0 ]